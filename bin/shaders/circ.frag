@@ -3,8 +3,7 @@
 // input from vertex shader
 in vec3 norm;
 in vec2 tc;
-
-uniform vec4 solid_color;
+flat in vec4 solid_color;
 
 // the only output variable
 out vec4 fragColor;
@@ -1,20 +1,30 @@
 #version 330
 
+// per-frame constants shared with the text program
+layout(std140) uniform frame_block
+{
+	layout(row_major) mat4 view_matrix;
+	layout(row_major) mat4 projection_matrix;
+	vec4 viewport;	// width, height, 1/width, 1/height in pixels
+	vec4 time;		// x: seconds since start, y: simulation parameter
+};
+
 // vertex attributes
-in vec3 position;
-in vec3 normal;
-in vec2 texcoord;
+layout(location=0) in vec3 position;
+layout(location=1) in vec3 normal;
+layout(location=2) in vec2 texcoord;
 
-// matrices
-uniform mat4 model_matrix;
-uniform mat4 view_matrix;
-uniform mat4 projection_matrix;
+// per-instance attributes
+layout(location=3) in mat4 instance_matrix;	// row-major model matrix; occupies locations 3-6
+layout(location=7) in vec4 instance_color;
 
 out vec3 norm;
 out vec2 tc;
+flat out vec4 solid_color;
 
 void main()
 {
+	mat4 model_matrix = transpose(instance_matrix);	// rows are fed as columns
 	vec4 wpos = model_matrix * vec4(position,1);
 	vec4 epos = view_matrix * wpos;
 	gl_Position = projection_matrix * epos;
@@ -22,4 +32,5 @@ void main()
 	// pass eye-coordinate normal to fragment shader
 	norm = normalize(mat3(view_matrix*model_matrix)*normal);
 	tc = texcoord;
+	solid_color = instance_color;
 }
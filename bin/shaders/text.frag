@@ -1,12 +1,13 @@
 #version 330
 in vec2 TexCoords;
+in vec4 TextColor;
+flat in float TexLayer;
 out vec4 color;
 
-uniform sampler2D text;
-uniform vec4 textColor;
+uniform sampler2DArray text;
 
 void main()
 {    
-    vec4 sampled = vec4(1.0, 1.0, 1.0, texture(text, TexCoords).r);
-    color = vec4(textColor) * sampled;
+    vec4 sampled = vec4(1.0, 1.0, 1.0, texture(text, vec3(TexCoords, TexLayer)).r);
+    color = TextColor * sampled;
 }  
@@ -1,20 +1,26 @@
 #version 330
-//layout (location = 0) in vec4 vertex; // <vec2 pos, vec2 tex>
-in vec4 vertex; // <vec2 pos, vec2 tex>
-out vec2 TexCoords;
 
-//uniform vec2 window_size;
-//uniform vec2 text_translate;
-uniform mat4 text_matrix;
-//uniform
+// per-frame constants shared with the scene program
+layout(std140) uniform frame_block
+{
+	layout(row_major) mat4 view_matrix;
+	layout(row_major) mat4 projection_matrix;
+	vec4 viewport;	// width, height, 1/width, 1/height in pixels
+	vec4 time;		// x: seconds since start, y: simulation parameter
+};
+
+layout(location=0) in vec4 vertex; // <vec2 pos, vec2 tex>; pos in pixels, y growing upward from the top edge
+layout(location=1) in vec4 color;
+layout(location=2) in float layer; // atlas layer of the glyph
+out vec2 TexCoords;
+out vec4 TextColor;
+flat out float TexLayer;
 
 void main()
 {
-	//vec2 vertCoords, offset;
-	//offset.x = -(window_size.x / 2.0);
-	//offset.y =   window_size.y / 2.0;
-	//vertCoords.x = (offset.x + vertex.x + text_translate.x) / (window_size.x / 2.0);
-	//vertCoords.y = (offset.y + vertex.y - text_translate.y) / (window_size.y / 2.0);
-    gl_Position = text_matrix * vec4(vertex.xy, -0.1, 1.0);
+    vec2 ndc = vertex.xy * 2.0 * viewport.zw + vec2(-1.0, 1.0);	// view space conversion
+    gl_Position = vec4(ndc, -0.1, 1.0);
     TexCoords = vertex.zw;
-}  
+    TextColor = color;
+    TexLayer = layer;
+}
@@ -0,0 +1,16 @@
+#version 330
+in vec2 TexCoords;
+in vec4 TextColor;
+flat in float TexLayer;
+out vec4 color;
+
+uniform sampler2DArray text;
+
+void main()
+{
+    // the glyph edge sits at 0.5; smooth it over one screen pixel at any scale
+    float dist = texture(text, vec3(TexCoords, TexLayer)).r;
+    float width = fwidth(dist);
+    float alpha = smoothstep(0.5 - width, 0.5 + width, dist);
+    color = TextColor * vec4(1.0, 1.0, 1.0, alpha);
+}
@@ -18,11 +18,23 @@
 #define __CGUT_H__
 
 // minimum standard headers
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <vector>
 #include <map>
 #include <set>
+// cgmath.h defines function-like min/max macros, which break <chrono> and <thread> when it is included first
+#pragma push_macro("min")
+#pragma push_macro("max")
+#undef min
+#undef max
+#include <atomic>
+#include <chrono>
+#include <thread>
+#pragma pop_macro("max")
+#pragma pop_macro("min")
 
 // enforce not to use /MD or /MDd flag
 #if defined(_MSC_VER)
@@ -31,6 +43,12 @@
 	#endif
 	#include <direct.h>
 	#include <io.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <time.h>
+	#include <unistd.h>
 #endif
 
 #define GLFW_INCLUDE_NONE
@@ -45,6 +63,10 @@
 #elif defined(_MSC_VER)
 	#pragma comment( lib, "glfw3dll.lib" )	// dynamic lib for other VC version
 #endif
+#if defined(_MSC_VER)
+	#include <mmsystem.h>					// timeBeginPeriod() for the frame pacer
+	#pragma comment( lib, "winmm.lib" )
+#endif
 
 //*************************************
 // OpenGL versions
@@ -59,6 +81,17 @@ struct gl_version_t
 	int glsl(){ return instance().major_glsl*10+instance().minor_glsl;}
 };
 
+//*************************************
+// optional features and limits reported by cg_init_extensions()
+struct gl_extensions_t
+{
+	bool	buffer_storage = false;		// glBufferStorage with persistent mapping (GL 4.4 or ARB_buffer_storage)
+	bool	base_instance = false;		// draws with a base instance (GL 4.2 or ARB_base_instance)
+	bool	program_binary = false;		// glGetProgramBinary/glProgramBinary with at least one format (GL 4.1 or ARB_get_program_binary)
+	GLint	uniform_buffer_alignment = 256;	// GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+	static gl_extensions_t& instance(){ static gl_extensions_t e; return e; }
+};
+
 //*************************************
 // module file path
 #ifdef _MSC_VER
@@ -90,11 +123,317 @@ struct mesh
 	std::vector<uint>	index_list;
 	GLuint				vertex_buffer = 0;
 	GLuint				index_buffer = 0;
+	GLuint				vertex_array = 0;	// vertex layout and buffers, specified once
 	GLuint				texture = 0;
 };
 
+//*************************************
+// typed handle of a uniform location, resolved once after linking
+template <class T> struct uniform_t
+{
+	GLint	loc = -1;
+	void	set( const T& v ) const;
+	static bool accepts( GLenum type );	// whether T can be uploaded to a uniform of the GLSL type
+};
+
+template<> inline void uniform_t<int>::set( const int& v ) const { if(loc>-1) glUniform1i( loc, v ); }
+template<> inline void uniform_t<float>::set( const float& v ) const { if(loc>-1) glUniform1f( loc, v ); }
+template<> inline void uniform_t<vec2>::set( const vec2& v ) const { if(loc>-1) glUniform2fv( loc, 1, &v.x ); }
+template<> inline void uniform_t<vec3>::set( const vec3& v ) const { if(loc>-1) glUniform3fv( loc, 1, &v.x ); }
+template<> inline void uniform_t<vec4>::set( const vec4& v ) const { if(loc>-1) glUniform4fv( loc, 1, &v.x ); }
+template<> inline void uniform_t<mat4>::set( const mat4& m ) const { if(loc>-1) glUniformMatrix4fv( loc, 1, GL_TRUE, m ); }	// cgmath is row-major
+
+template<> inline bool uniform_t<int>::accepts( GLenum type ){ return type==GL_INT||type==GL_BOOL||type==GL_SAMPLER_2D||type==GL_SAMPLER_2D_ARRAY; }
+template<> inline bool uniform_t<float>::accepts( GLenum type ){ return type==GL_FLOAT; }
+template<> inline bool uniform_t<vec2>::accepts( GLenum type ){ return type==GL_FLOAT_VEC2; }
+template<> inline bool uniform_t<vec3>::accepts( GLenum type ){ return type==GL_FLOAT_VEC3; }
+template<> inline bool uniform_t<vec4>::accepts( GLenum type ){ return type==GL_FLOAT_VEC4; }
+template<> inline bool uniform_t<mat4>::accepts( GLenum type ){ return type==GL_FLOAT_MAT4; }
+
+//*************************************
+// per-frame constants shared by all the programs through the std140 block "frame_block"
+struct frame_block_t
+{
+	static const GLuint BINDING = 0;	// fixed binding point; set up by cg_reflect_program()
+
+	mat4	view_matrix;
+	mat4	projection_matrix;
+	vec4	viewport;		// width, height, 1/width, 1/height in pixels
+	vec4	time;			// x: seconds since start, y: simulation parameter
+};
+
+//*************************************
+// GPU program with its active uniforms/attributes reflected at link time
+struct program_t
+{
+	struct variable_t { GLint loc=-1; GLenum type=0; };
+
+	GLuint	ID = 0;
+	std::map<std::string,variable_t>	uniforms;		// active uniforms outside blocks; arrays by their base name
+	std::map<std::string,variable_t>	attributes;		// active vertex attributes
+	std::map<std::string,GLuint>		blocks;			// active uniform blocks and their indices
+	GLint	vertex_attrib[3] = {-1,-1,-1};				// locations of position, normal, texcoord of vertex
+
+	operator GLuint() const { return ID; }
+	GLint attribute( const char* name ) const { auto it=attributes.find(name); return it==attributes.end()?-1:it->second.loc; }
+	template <class T> uniform_t<T> uniform( const char* name ) const;
+};
+
+template <class T> inline uniform_t<T> program_t::uniform( const char* name ) const
+{
+	uniform_t<T> u;
+	auto it=uniforms.find(name); if(it==uniforms.end()) return u;	// inactive or optimized out
+	if(!uniform_t<T>::accepts(it->second.type)){ printf( "%s(): type mismatch for uniform %s\n", __FUNCTION__, name ); return u; }
+	u.loc = it->second.loc;
+	return u;
+}
+
+//*************************************
+// draw ranges of meshes packed into a shared vertex/index buffer pair
+struct mesh_range
+{
+	GLuint	base_vertex = 0;	// added to every index of the mesh
+	GLuint	vertex_count = 0;	// vertices of the mesh from base_vertex
+	GLuint	first_index = 0;	// offset to the first index of the mesh
+	GLuint	index_count = 0;	// number of indices of the mesh
+};
+
+struct mesh_registry
+{
+	std::vector<mesh_range>	ranges;
+	GLuint	vertex_total = 0;	// vertices in the shared vertex buffer
+	GLuint	index_total = 0;	// indices in the shared index buffer
+
+	uint add( std::vector<vertex>& vertex_list, std::vector<uint>& index_list, const vertex* vertices, GLuint vertex_count, const uint* indices, GLuint index_count );
+	void clear(){ ranges.clear(); vertex_total=index_total=0; }
+	void draw( uint handle, GLsizei instance_count=1, bool indexed=true, GLuint base_instance=0 ) const;
+	const mesh_range& operator[]( uint handle ) const { return ranges[handle]; }
+};
+
+//*************************************
+// statistics of GPU objects owned by gl_buffer_t and gl_texture_t
+struct gpu_stats_t
+{
+	int		buffers=0, textures=0;				// live objects
+	size_t	buffer_bytes=0, texture_bytes=0;	// storage of the live objects
+	uint	uploads=0;							// storage (re)specifications so far
+	static gpu_stats_t& instance(){ static gpu_stats_t s; return s; }
+	void print( const char* tag ) const { printf( "[%s] %d buffers (%zu bytes), %d textures (%zu bytes), %u uploads\n", tag, buffers, buffer_bytes, textures, texture_bytes, uploads ); }
+};
+
+// owning handle of a buffer object
+struct gl_buffer_t
+{
+	GLuint	ID = 0;
+	GLenum	target = GL_ARRAY_BUFFER;
+	size_t	size = 0;	// bytes of the current storage
+
+	gl_buffer_t() = default;
+	gl_buffer_t( const gl_buffer_t& ) = delete;
+	gl_buffer_t( gl_buffer_t&& b ) noexcept { *this=std::move(b); }
+	~gl_buffer_t(){ release(); }
+	gl_buffer_t& operator=( const gl_buffer_t& ) = delete;
+	gl_buffer_t& operator=( gl_buffer_t&& b ) noexcept { if(this!=&b){ release(); ID=b.ID; target=b.target; size=b.size; b.ID=0; b.size=0; } return *this; }
+	operator GLuint() const { return ID; }
+
+	void create( GLenum _target ){ release(); target=_target; glGenBuffers( 1, &ID ); gpu_stats_t::instance().buffers++; }
+	void storage( size_t bytes, GLbitfield flags )	// immutable storage
+	{
+		gpu_stats_t& s = gpu_stats_t::instance(); s.buffer_bytes += bytes-size; size = bytes;
+		glBindBuffer( target, ID );
+		glBufferStorage( target, GLsizeiptr(bytes), nullptr, flags );
+	}
+	void data( const void* ptr, size_t bytes, GLenum usage=GL_STATIC_DRAW )
+	{
+		gpu_stats_t& s = gpu_stats_t::instance(); s.buffer_bytes += bytes-size; s.uploads++; size = bytes;
+		glBindBuffer( target, ID );
+		glBufferData( target, GLsizeiptr(bytes), ptr, usage );
+	}
+	void sub_data( size_t offset, const void* ptr, size_t bytes )	// update a part of the current storage
+	{
+		gpu_stats_t::instance().uploads++;
+		glBindBuffer( target, ID );
+		glBufferSubData( target, GLintptr(offset), GLsizeiptr(bytes), ptr );
+	}
+	void release()
+	{
+		if(!ID) return;
+		gpu_stats_t& s = gpu_stats_t::instance(); s.buffers--; s.buffer_bytes -= size;
+		glDeleteBuffers( 1, &ID ); ID=0; size=0;
+	}
+};
+
+// owning handle of a 2D texture object
+struct gl_texture_t
+{
+	GLuint	ID = 0;
+	size_t	size = 0;	// bytes of the base level
+
+	gl_texture_t() = default;
+	gl_texture_t( const gl_texture_t& ) = delete;
+	gl_texture_t( gl_texture_t&& t ) noexcept { *this=std::move(t); }
+	~gl_texture_t(){ release(); }
+	gl_texture_t& operator=( const gl_texture_t& ) = delete;
+	gl_texture_t& operator=( gl_texture_t&& t ) noexcept { if(this!=&t){ release(); ID=t.ID; size=t.size; t.ID=0; t.size=0; } return *this; }
+	operator GLuint() const { return ID; }
+
+	static size_t texel_bytes( GLenum format, GLenum type ){ return (format==GL_RED?1:format==GL_RG?2:format==GL_RGB?3:4)*(type==GL_FLOAT?4:1); }
+	void create(){ release(); glGenTextures( 1, &ID ); gpu_stats_t::instance().textures++; }
+	void image2d( GLint internal_format, GLsizei width, GLsizei height, GLenum format, GLenum type, const void* pixels )
+	{
+		size_t bytes = size_t(width)*size_t(height)*texel_bytes(format,type);
+		gpu_stats_t& s = gpu_stats_t::instance(); s.texture_bytes += bytes-size; s.uploads++; size = bytes;
+		glBindTexture( GL_TEXTURE_2D, ID );
+		glTexImage2D( GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, pixels );
+	}
+	void image2d_array( GLint internal_format, GLsizei width, GLsizei height, GLsizei layers, GLenum format, GLenum type, const void* pixels )
+	{
+		size_t bytes = size_t(width)*size_t(height)*size_t(layers)*texel_bytes(format,type);
+		gpu_stats_t& s = gpu_stats_t::instance(); s.texture_bytes += bytes-size; s.uploads++; size = bytes;
+		glBindTexture( GL_TEXTURE_2D_ARRAY, ID );
+		glTexImage3D( GL_TEXTURE_2D_ARRAY, 0, internal_format, width, height, layers, 0, format, type, pixels );
+	}
+	void sub_image2d_array( GLint x, GLint y, GLint layer, GLsizei width, GLsizei height, GLenum format, GLenum type, const void* pixels )	// update a part of a layer
+	{
+		gpu_stats_t::instance().uploads++;
+		glBindTexture( GL_TEXTURE_2D_ARRAY, ID );
+		glTexSubImage3D( GL_TEXTURE_2D_ARRAY, 0, x, y, layer, width, height, 1, format, type, pixels );
+	}
+	void release()
+	{
+		if(!ID) return;
+		gpu_stats_t& s = gpu_stats_t::instance(); s.textures--; s.texture_bytes -= size;
+		glDeleteTextures( 1, &ID ); ID=0; size=0;
+	}
+};
+
+//*************************************
+// ring buffer for per-frame data: one region per frame in flight, each guarded by a fence.
+// persistently mapped when buffer storage is supported; otherwise, the frame's data is
+// staged in host memory and uploaded by glBufferSubData into an orphaned buffer.
+struct gl_ring_buffer_t
+{
+	static const int REGIONS = 3;	// triple buffering
+
+	gl_buffer_t			buffer;
+	size_t				region_size = 0;	// bytes available to a frame
+	int					region = 0;			// region of the current frame
+	size_t				cursor = 0;			// bytes allocated in the current region
+	GLsync				fence[REGIONS] = {};
+	char*				mapped = nullptr;	// persistent mapping of the whole buffer
+	std::vector<char>	shadow;				// host staging of the current region (fallback)
+	size_t				flushed = 0;		// bytes of shadow already uploaded (fallback)
+
+	void	create( size_t bytes_per_frame, GLenum target=GL_ARRAY_BUFFER );
+	void	release();
+	void	begin_frame();
+	void	end_frame();
+	void*	alloc( size_t bytes, size_t align, size_t& offset );	// offset in the buffer; nullptr when the region is full
+	void	commit();												// make allocations visible to the following draws
+	bool	persistent() const { return mapped!=nullptr; }
+};
+
+inline void gl_ring_buffer_t::create( size_t bytes_per_frame, GLenum target )
+{
+	release();
+	region_size = bytes_per_frame;
+	buffer.create( target );
+	if(gl_extensions_t::instance().buffer_storage)
+	{
+		const GLbitfield flags = GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_COHERENT_BIT;
+		buffer.storage( region_size*REGIONS, flags );
+		mapped = (char*) glMapBufferRange( target, 0, GLsizeiptr(region_size*REGIONS), flags );
+		if(!mapped) buffer.create( target );	// immutable storage cannot be respecified by the fallback below; start over with a new buffer
+	}
+	if(!mapped)
+	{
+		buffer.data( nullptr, region_size, GL_STREAM_DRAW );
+		shadow.resize( region_size );
+	}
+	region = 0; cursor = flushed = 0;
+}
+
+inline void gl_ring_buffer_t::release()
+{
+	for( auto& f : fence ){ if(f) glDeleteSync(f); f=nullptr; }
+	if(mapped){ glBindBuffer( buffer.target, buffer ); glUnmapBuffer( buffer.target ); mapped=nullptr; }
+	buffer.release();
+	shadow.clear();
+}
+
+inline void gl_ring_buffer_t::begin_frame()
+{
+	cursor = flushed = 0;
+	if(!persistent()){ buffer.data( nullptr, region_size, GL_STREAM_DRAW ); return; }	// orphan the previous frame's storage
+
+	// wait until the GPU has consumed what was written into this region three frames ago
+	region = (region+1)%REGIONS;
+	GLsync& f = fence[region]; if(!f) return;
+	while( glClientWaitSync( f, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000 )==GL_TIMEOUT_EXPIRED );
+	glDeleteSync(f); f=nullptr;
+}
+
+inline void gl_ring_buffer_t::end_frame()
+{
+	if(!persistent()) return;
+	if(fence[region]) glDeleteSync( fence[region] );
+	fence[region] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+}
+
+inline void* gl_ring_buffer_t::alloc( size_t bytes, size_t align, size_t& offset )
+{
+	// align the offset in the buffer (not in the region), so that offset/stride indexes vertices or instances
+	const size_t base = persistent() ? region_size*region : 0;
+	size_t begin = (base+cursor+align-1)/align*align - base;
+	if(begin+bytes>region_size){ printf( "%s(): %zu bytes exceed the frame region\n", __FUNCTION__, bytes ); return nullptr; }
+	cursor = begin+bytes;
+	offset = base+begin;
+	return persistent() ? mapped+offset : &shadow[begin];
+}
+
+inline void gl_ring_buffer_t::commit()
+{
+	if(persistent()||flushed>=cursor) return;	// coherent mapping needs no flush
+	glBindBuffer( buffer.target, buffer );
+	glBufferSubData( buffer.target, GLintptr(flushed), GLsizeiptr(cursor-flushed), &shadow[flushed] );
+	flushed = cursor;
+}
+
+// write the per-frame constants into the ring once, and bind them for every program at the fixed binding point
+inline void cg_bind_frame_block( gl_ring_buffer_t& ring, const mat4& view_matrix, const mat4& projection_matrix, ivec2 viewport, float t )
+{
+	size_t offset = 0;
+	frame_block_t* block = (frame_block_t*) ring.alloc( sizeof(frame_block_t), gl_extensions_t::instance().uniform_buffer_alignment, offset );
+	if(!block) return;
+	*block = {	view_matrix, projection_matrix,
+				vec4( float(viewport.x), float(viewport.y), 1.0f/viewport.x, 1.0f/viewport.y ),
+				vec4( float(glfwGetTime()), t, 0.0f, 0.0f ) };
+	ring.commit();
+	glBindBufferRange( GL_UNIFORM_BUFFER, frame_block_t::BINDING, ring.buffer, GLintptr(offset), sizeof(frame_block_t) );
+}
+
+//*************************************
+// counter of vertex attribute specifications; it stays constant over frames once vertex arrays are built
+inline uint& cg_attrib_pointer_count(){ static uint n=0; return n; }
+
+inline void cg_vertex_attrib_pointer( GLuint loc, GLint size, GLsizei stride, size_t byte_offset, GLuint divisor=0 )
+{
+	cg_attrib_pointer_count()++;
+	glEnableVertexAttribArray( loc );
+	glVertexAttribPointer( loc, size, GL_FLOAT, GL_FALSE, stride, (GLvoid*) byte_offset );
+	if(divisor) glVertexAttribDivisor( loc, divisor );
+}
+
 //*************************************
 // utility functions
+// 64-bit FNV-1a hash; chain calls through seed to hash several fields
+inline uint64_t cg_hash( const void* data, size_t size, uint64_t seed=14695981039346656037ull )
+{
+	const unsigned char* p = (const unsigned char*) data;
+	for( size_t k=0; k < size; k++ ){ seed ^= p[k]; seed *= 1099511628211ull; }
+	return seed;
+}
+
 inline mem_t cg_read_binary( const char* file_path )
 {
 	mem_t m;
@@ -109,6 +448,66 @@ inline mem_t cg_read_binary( const char* file_path )
 	return m;
 }
 
+// read-only view of a whole file mapped into memory
+struct mapped_file_t
+{
+	const unsigned char*	ptr = nullptr;
+	size_t					size = 0;
+
+	mapped_file_t() = default;
+	mapped_file_t( const mapped_file_t& ) = delete;
+	mapped_file_t& operator=( const mapped_file_t& ) = delete;
+	~mapped_file_t(){ close(); }
+	operator bool() const { return ptr!=nullptr; }
+
+	bool open( const char* file_path );
+	void close();
+};
+
+inline bool mapped_file_t::open( const char* file_path )
+{
+	close();
+#ifdef _MSC_VER
+	HANDLE file = CreateFileA( file_path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr ); if(file==INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER file_size; if(!GetFileSizeEx( file, &file_size )||file_size.QuadPart==0){ CloseHandle(file); return false; }
+	HANDLE mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+	CloseHandle( file ); if(!mapping) return false;
+	ptr = (const unsigned char*) MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+	CloseHandle( mapping ); if(!ptr) return false;	// the view keeps the mapping alive
+	size = size_t(file_size.QuadPart);
+#else
+	int fd = ::open( file_path, O_RDONLY ); if(fd<0) return false;
+	struct stat st; if(fstat( fd, &st )!=0||st.st_size==0){ ::close(fd); return false; }
+	void* view = mmap( nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0 );
+	::close( fd ); if(view==MAP_FAILED) return false;	// the view keeps the file alive
+	ptr = (const unsigned char*) view; size = size_t(st.st_size);
+#endif
+	return true;
+}
+
+inline void mapped_file_t::close()
+{
+	if(!ptr) return;
+#ifdef _MSC_VER
+	UnmapViewOfFile( ptr );
+#else
+	munmap( (void*) ptr, size );
+#endif
+	ptr=nullptr; size=0;
+}
+
+// path relative to the directory of the executable on Windows, and to the working directory elsewhere
+inline std::string cg_resolve_path( const char* file_path )
+{
+#ifdef _MSC_VER
+	if(file_path[0]=='/'||file_path[0]=='\\'||(file_path[0]&&file_path[1]==':')) return file_path;
+	module_path_t mpath;
+	return std::string(mpath.drive)+mpath.dir+file_path;
+#else
+	return file_path;
+#endif
+}
+
 inline char* cg_read_shader( const char* file_path )
 {
 #ifdef _MSC_VER
@@ -184,6 +583,29 @@ inline const char* cg_conf_path()
 }
 #endif
 
+// directory for files derived from assets: %TEMP%\.cgbase\ on Windows, and ~/.cache/cgbase/ elsewhere
+inline const char* cg_cache_dir()
+{
+	static const std::string cache_dir = []()	// initialized once, even with calls from several threads
+	{
+		std::string dir;
+#ifdef _MSC_VER
+		char temp[_MAX_PATH]; GetTempPathA( _MAX_PATH-1, temp );
+		dir = temp; if(!dir.empty()&&dir.back()!='\\') dir += '\\';
+		dir += ".cgbase\\";
+		if(_access(dir.c_str(),0)!=0) _mkdir( dir.c_str() );
+#else
+		const char* xdg = getenv( "XDG_CACHE_HOME" ); const char* home = getenv( "HOME" );
+		if(xdg&&xdg[0]) dir = std::string(xdg)+"/";
+		else { dir = std::string(home?home:"/tmp")+"/.cache/"; mkdir( dir.c_str(), 0755 ); }
+		dir += "cgbase/";
+		mkdir( dir.c_str(), 0755 );
+#endif
+		return dir;
+	}();
+	return cache_dir.c_str();
+}
+
 inline ivec2 cg_default_window_size()
 {
 #ifdef GL_ES_VERSION_2_0
@@ -255,6 +677,113 @@ inline void cg_destroy_window( GLFWwindow* window )
 	glfwTerminate();
 }
 
+//*************************************
+// CPU time used by all the threads of this process, in seconds
+inline double cg_process_cpu_seconds()
+{
+#ifdef _MSC_VER
+	FILETIME creation, exited, kernel, user;
+	if(!GetProcessTimes( GetCurrentProcess(), &creation, &exited, &kernel, &user )) return 0;
+	auto seconds = []( const FILETIME& f ){ return double((unsigned long long)(f.dwHighDateTime)<<32|f.dwLowDateTime)*1e-7; };	// 100 ns units
+	return seconds(kernel)+seconds(user);
+#else
+	timespec ts; if(clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &ts )) return 0;
+	return double(ts.tv_sec)+double(ts.tv_nsec)*1e-9;
+#endif
+}
+
+//*************************************
+// frame pacing: wait for vsync, sleep until a deadline and spin the rest, or run uncapped
+enum pace_mode_t { PACE_VSYNC, PACE_HYBRID, PACE_UNCAPPED };
+
+struct frame_pacer_t
+{
+	typedef std::chrono::steady_clock clock;
+	pace_mode_t	mode = PACE_HYBRID;
+	double		rate = 200.0;		// target frames per second of the hybrid mode
+	double		spin = 0.0005;		// seconds before the deadline to stop sleeping and spin; follows the measured oversleep
+	clock::time_point	deadline, last, begin;
+	uint		frames=0;			// frame intervals measured so far
+	double		sum=0, sumsq=0, worst=0;	// sum, squared sum and maximum of the intervals in seconds
+	double		cpu_begin=0;		// process CPU time at start()
+
+	void start( pace_mode_t m, double hz );	// call with the context current; sets the swap interval
+	void stop();
+	void wait();		// returns at the start of the next frame
+	void print();		// report the frame interval and its jitter
+};
+
+inline void frame_pacer_t::start( pace_mode_t m, double hz )
+{
+	mode = m; rate = hz>0 ? hz : 200.0;
+	glfwSwapInterval( mode==PACE_VSYNC ? 1 : 0 );	// vsync blocks in glfwSwapBuffers(), so wait() has nothing to do
+#ifdef _MSC_VER
+	timeBeginPeriod(1);		// 1 ms scheduler granularity, so that a sleep does not overshoot by a whole 15.6 ms tick
+#endif
+	deadline = last = begin = clock::now();
+	frames=0; sum=sumsq=worst=0;
+	cpu_begin = cg_process_cpu_seconds();
+}
+
+inline void frame_pacer_t::stop()
+{
+#ifdef _MSC_VER
+	timeEndPeriod(1);
+#endif
+}
+
+inline void frame_pacer_t::wait()
+{
+	if(mode==PACE_HYBRID)
+	{
+		const clock::duration period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0/rate));
+		const clock::duration margin = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(spin));
+		deadline += period;
+		clock::time_point now = clock::now();
+		if(now>deadline+period) deadline=now;	// more than a frame behind (a stall or a window drag): restart the schedule instead of catching up
+		if(deadline-now>margin)
+		{
+			// spin only as long as the sleeps overshoot: jump to a late wake-up at once, and decay slowly
+			std::this_thread::sleep_until( deadline-margin );
+			double oversleep = std::chrono::duration<double>(clock::now()-(deadline-margin)).count();
+			oversleep = oversleep*1.25+0.00005;
+			spin = oversleep>spin ? oversleep : spin*0.98+oversleep*0.02;
+			spin = spin<0.0001 ? 0.0001 : spin>0.001 ? 0.001 : spin;
+		}
+		while(clock::now()<deadline) std::this_thread::yield();
+	}
+
+	clock::time_point now = clock::now();
+	double dt = std::chrono::duration<double>(now-last).count(); last=now;
+	if(frames++==0) return;		// the first interval includes the startup
+	sum += dt; sumsq += dt*dt; worst = dt>worst ? dt : worst;
+}
+
+inline void frame_pacer_t::print()
+{
+	uint n = frames>1 ? frames-1 : 0; if(!n) return;
+	double mean = sum/n, var = sumsq/n-mean*mean;
+	static const char* names[] = { "vsync", "hybrid", "uncapped" };
+	double wall = std::chrono::duration<double>(clock::now()-begin).count(), cpu = cg_process_cpu_seconds()-cpu_begin;
+	printf( "frame pacing (%s): %u frames, mean %.3f ms (%.1f fps), jitter %.3f ms, max %.3f ms, spin %.3f ms\n",
+		names[mode], n, mean*1000.0, 1.0/mean, sqrt(var>0?var:0)*1000.0, worst*1000.0, spin*1000.0 );
+	printf( "process CPU time: %.2f s in %.2f s (%.1f%% of a core)\n", cpu, wall, wall>0 ? cpu/wall*100.0 : 0.0 );
+}
+
+//*************************************
+// lock-free queue of a single producer thread and a single consumer thread; N should be a power of two
+template <class T, uint N> struct spsc_queue_t
+{
+	T					items[N];
+	std::atomic<uint>	head{0};	// next item to pop; written by the consumer only
+	std::atomic<uint>	tail{0};	// next slot to push; written by the producer only
+
+	bool push( const T& v ){ uint t=tail.load(std::memory_order_relaxed); if(t-head.load(std::memory_order_acquire)==N) return false; items[t%N]=v; tail.store(t+1,std::memory_order_release); return true; }
+	bool peek( T& v ) const { uint h=head.load(std::memory_order_relaxed); if(h==tail.load(std::memory_order_acquire)) return false; v=items[h%N]; return true; }
+	bool pop( T& v ){ if(!peek(v)) return false; head.store(head.load(std::memory_order_relaxed)+1,std::memory_order_release); return true; }
+	uint size() const { return tail.load(std::memory_order_acquire)-head.load(std::memory_order_acquire); }
+};
+
 inline bool cg_init_extensions( GLFWwindow* window )
 {
 	glfwMakeContextCurrent(window);	// make sure the current context again
@@ -300,6 +829,15 @@ inline bool cg_init_extensions( GLFWwindow* window )
 		CHECK_GL_EXT( fragment_shader );		// functions related to fragment shaders
 		CHECK_GL_EXT( shader_objects );			// functions related to program and shaders
 	#undef CHECK_GL_EXT
+
+	// optional features; glad loads their entry points only with the core versions
+	gl_extensions_t& e = gl_extensions_t::instance();
+	e.buffer_storage = GLAD_GL_VERSION_4_4 && glBufferStorage!=nullptr;
+	e.base_instance = GLAD_GL_VERSION_4_2 && glDrawElementsInstancedBaseVertexBaseInstance!=nullptr;
+	glGetIntegerv( GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &e.uniform_buffer_alignment );
+	GLint binary_formats=0; if(GLAD_GL_VERSION_4_1&&glProgramBinary!=nullptr) glGetIntegerv( GL_NUM_PROGRAM_BINARY_FORMATS, &binary_formats );
+	e.program_binary = binary_formats>0;
+	if(!e.buffer_storage) printf( "Warning: buffer storage not supported; per-frame data falls back to buffer orphaning.\n" );
 #endif
 
 	printf( "\n" );
@@ -356,6 +894,7 @@ inline GLuint cg_create_program_from_string( const char* vertex_shader_source, c
 	// try to create a program
 	GLuint program = glCreateProgram();
 	glUseProgram( program );
+	if(gl_extensions_t::instance().program_binary) glProgramParameteri( program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE );
 
 	// create shaders
 	std::string log;
@@ -375,13 +914,115 @@ inline GLuint cg_create_program_from_string( const char* vertex_shader_source, c
 	return program;
 }
 
-inline GLuint cg_create_program( const char* vert_path, const char* frag_path )
+inline void cg_reflect_program( program_t& program )
 {
-	const char* vertex_shader_source = cg_read_shader( vert_path ); if(vertex_shader_source==NULL) return 0;
-	const char* fragment_shader_source = cg_read_shader( frag_path ); if(fragment_shader_source==NULL) return 0;
+	GLint count=0, max_length=0;
+	std::vector<GLchar> name;
 
-	// try to create a program
-	GLuint program = cg_create_program_from_string( vertex_shader_source, fragment_shader_source );
+	// active uniforms; members of uniform blocks have no location
+	glGetProgramiv( program.ID, GL_ACTIVE_UNIFORMS, &count );
+	glGetProgramiv( program.ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length ); name.resize(max_length+1);
+	for( GLint k=0; k<count; k++ )
+	{
+		GLsizei length=0; GLint size=0; program_t::variable_t v;
+		glGetActiveUniform( program.ID, GLuint(k), GLsizei(name.size()), &length, &size, &v.type, &name[0] );
+		if((v.loc=glGetUniformLocation( program.ID, &name[0] ))<0) continue;
+		std::string n( &name[0], length ); size_t b=n.find('['); if(b!=std::string::npos) n.resize(b);
+		program.uniforms[n] = v;
+	}
+
+	// active vertex attributes
+	glGetProgramiv( program.ID, GL_ACTIVE_ATTRIBUTES, &count );
+	glGetProgramiv( program.ID, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &max_length ); name.resize(max_length+1);
+	for( GLint k=0; k<count; k++ )
+	{
+		GLsizei length=0; GLint size=0; program_t::variable_t v;
+		glGetActiveAttrib( program.ID, GLuint(k), GLsizei(name.size()), &length, &size, &v.type, &name[0] );
+		if((v.loc=glGetAttribLocation( program.ID, &name[0] ))<0) continue;	// built-ins such as gl_VertexID
+		program.attributes[std::string(&name[0],length)] = v;
+	}
+
+	// active uniform blocks; the frame block gets its fixed binding point
+	glGetProgramiv( program.ID, GL_ACTIVE_UNIFORM_BLOCKS, &count );
+	glGetProgramiv( program.ID, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &max_length ); name.resize(max_length+1);
+	for( GLint k=0; k<count; k++ )
+	{
+		GLsizei length=0;
+		glGetActiveUniformBlockName( program.ID, GLuint(k), GLsizei(name.size()), &length, &name[0] );
+		std::string n( &name[0], length ); program.blocks[n] = GLuint(k);
+		if(n=="frame_block") glUniformBlockBinding( program.ID, GLuint(k), frame_block_t::BINDING );
+	}
+
+	const char* vertex_attrib_names[] = { "position", "normal", "texcoord" };
+	for( int k=0; k<3; k++ ) program.vertex_attrib[k] = program.attribute(vertex_attrib_names[k]);
+}
+
+//*************************************
+// program binaries cached in cg_cache_dir(): one file per pair of shader paths, valid while the key matches
+struct program_binary_header_t
+{
+	char		magic[8];	// "CGPROG01"
+	uint64_t	key;		// hash of the sources and the driver
+	GLenum		format;		// binary format of the driver
+	GLint		length;		// bytes of the binary following the header
+};
+
+inline uint64_t cg_program_binary_key( const char* vertex_shader_source, const char* fragment_shader_source )
+{
+	uint64_t h = cg_hash( vertex_shader_source, strlen(vertex_shader_source) );
+	h = cg_hash( fragment_shader_source, strlen(fragment_shader_source), h );
+	for( GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION } ){ const char* s = (const char*) glGetString(name); if(s) h = cg_hash( s, strlen(s), h ); }
+	return h;
+}
+
+inline std::string cg_program_binary_path( const char* vert_path, const char* frag_path )
+{
+	uint64_t h = cg_hash( vert_path, strlen(vert_path) );
+	h = cg_hash( frag_path, strlen(frag_path), h );
+	char file_name[64]; snprintf( file_name, sizeof(file_name), "program_%016llx.bin", (unsigned long long) h );
+	return std::string(cg_cache_dir())+file_name;
+}
+
+inline GLuint cg_load_program_binary( const char* cache_path, uint64_t key )
+{
+	if(!gl_extensions_t::instance().program_binary) return 0;
+	mapped_file_t f; if(!f.open( cache_path )||f.size<sizeof(program_binary_header_t)) return 0;
+	const program_binary_header_t& header = *(const program_binary_header_t*) f.ptr;
+	if(memcmp( header.magic, "CGPROG01", 8 )!=0||header.key!=key||f.size!=sizeof(header)+size_t(header.length)) return 0;	// stale or broken
+
+	GLuint program = glCreateProgram();
+	glProgramBinary( program, header.format, f.ptr+sizeof(header), header.length );
+	GLint linked=0; glGetProgramiv( program, GL_LINK_STATUS, &linked );
+	if(!linked){ glDeleteProgram( program ); return 0; }	// rejected by the driver, e.g., after an update
+	return program;
+}
+
+inline void cg_save_program_binary( GLuint program, const char* cache_path, uint64_t key )
+{
+	if(!gl_extensions_t::instance().program_binary) return;
+	program_binary_header_t header = { { 'C','G','P','R','O','G','0','1' }, key, 0, 0 };
+	glGetProgramiv( program, GL_PROGRAM_BINARY_LENGTH, &header.length ); if(header.length<=0) return;
+	std::vector<char> binary( header.length );
+	glGetProgramBinary( program, header.length, &header.length, &header.format, &binary[0] );
+
+	FILE* fp = fopen( cache_path, "wb" ); if(!fp) return;
+	fwrite( &header, sizeof(header), 1, fp );
+	fwrite( &binary[0], 1, size_t(header.length), fp );
+	fclose( fp );
+}
+
+inline program_t cg_create_program( const char* vert_path, const char* frag_path )
+{
+	const char* vertex_shader_source = cg_read_shader( vert_path ); if(vertex_shader_source==NULL) return program_t();
+	const char* fragment_shader_source = cg_read_shader( frag_path ); if(fragment_shader_source==NULL) return program_t();
+
+	// reuse the binary of the same sources on the same driver, or compile the sources and keep their binary
+	const uint64_t key = cg_program_binary_key( vertex_shader_source, fragment_shader_source );
+	const std::string cache_path = cg_program_binary_path( vert_path, frag_path );
+	program_t program;
+	program.ID = cg_load_program_binary( cache_path.c_str(), key );
+	if(!program.ID&&(program.ID=cg_create_program_from_string( vertex_shader_source, fragment_shader_source ))!=0) cg_save_program_binary( program.ID, cache_path.c_str(), key );
+	if(program.ID) cg_reflect_program( program );
 
 	// deallocate string
 	free((void*)vertex_shader_source);
@@ -389,6 +1030,23 @@ inline GLuint cg_create_program( const char* vert_path, const char* frag_path )
 	return program;
 }
 
+// create a vertex array of the vertex layout; attributes are at locations 0, 1, 2 for position, normal, texcoord
+inline GLuint cg_create_vertex_array( GLuint vertex_buffer, GLuint index_buffer )
+{
+	GLuint vertex_array = 0;
+	glGenVertexArrays( 1, &vertex_array );
+	glBindVertexArray( vertex_array );
+	glBindBuffer( GL_ARRAY_BUFFER, vertex_buffer );
+	if(index_buffer) glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, index_buffer );	// captured by the vertex array
+
+	size_t attrib_size[] = { sizeof(vertex().pos), sizeof(vertex().norm), sizeof(vertex().tex) };
+	for( size_t k=0, byte_offset=0; k<3; k++, byte_offset+=attrib_size[k-1] )
+		cg_vertex_attrib_pointer( GLuint(k), GLint(attrib_size[k]/sizeof(GLfloat)), sizeof(vertex), byte_offset );
+
+	glBindVertexArray( 0 );
+	return vertex_array;
+}
+
 inline mesh* cg_load_mesh( const char* vert_binary_path, const char* index_binary_path )
 {
 	mesh* new_mesh = new mesh();
@@ -419,17 +1077,70 @@ inline mesh* cg_load_mesh( const char* vert_binary_path, const char* index_binar
 	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, new_mesh->index_buffer );
 	glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof(uint)*new_mesh->index_list.size(), &new_mesh->index_list[0], GL_STATIC_DRAW );
 
+	// create a vertex array; drawing needs only to bind it
+	new_mesh->vertex_array = cg_create_vertex_array( new_mesh->vertex_buffer, new_mesh->index_buffer );
+
 	return new_mesh;
 }
 
+// append a mesh to the host-side lists to be uploaded, and return its handle
+inline uint mesh_registry::add( std::vector<vertex>& vertex_list, std::vector<uint>& index_list, const vertex* vertices, GLuint vertex_count, const uint* indices, GLuint index_count )
+{
+	mesh_range r;
+	r.base_vertex = GLuint(vertex_list.size());
+	r.vertex_count = vertex_count;
+	r.first_index = GLuint(index_list.size());
+	r.index_count = index_count;
+#ifndef NDEBUG
+	for( GLuint k=0; k<index_count; k++ ) assert( indices[k]<vertex_count && "mesh index out of its own vertex range" );
+#endif
+
+	vertex_list.insert( vertex_list.end(), vertices, vertices+vertex_count );
+	index_list.insert( index_list.end(), indices, indices+index_count );
+	vertex_total = GLuint(vertex_list.size());
+	index_total = GLuint(index_list.size());
+
+	ranges.push_back(r);
+	return uint(ranges.size()-1);
+}
+
+// draw exactly the registered range of a mesh; the shared buffers should be bound
+inline void mesh_registry::draw( uint handle, GLsizei instance_count, bool indexed, GLuint base_instance ) const
+{
+#ifndef NDEBUG
+	assert( handle<ranges.size() && "unregistered mesh handle" );
+	const mesh_range& d = ranges[handle];
+	assert( d.base_vertex+d.vertex_count<=vertex_total && "mesh vertices beyond the vertex buffer" );
+	assert( d.first_index+d.index_count<=index_total && "mesh indices beyond the index buffer" );
+#endif
+	const mesh_range& r = ranges[handle];
+	assert( (!base_instance||gl_extensions_t::instance().base_instance) && "base instance draws need GL 4.2; offset the instance attributes instead" );
+	if(base_instance&&gl_extensions_t::instance().base_instance)
+	{
+		if(indexed)	glDrawElementsInstancedBaseVertexBaseInstance( GL_TRIANGLES, GLsizei(r.index_count), GL_UNSIGNED_INT, (GLvoid*)(sizeof(uint)*r.first_index), instance_count, GLint(r.base_vertex), base_instance );
+		else		glDrawArraysInstancedBaseInstance( GL_TRIANGLES, GLint(r.base_vertex), GLsizei(r.vertex_count), instance_count, base_instance );
+	}
+	else if(indexed)	glDrawElementsInstancedBaseVertex( GL_TRIANGLES, GLsizei(r.index_count), GL_UNSIGNED_INT, (GLvoid*)(sizeof(uint)*r.first_index), instance_count, GLint(r.base_vertex) );
+	else				glDrawArraysInstanced( GL_TRIANGLES, GLint(r.base_vertex), GLsizei(r.vertex_count), instance_count );
+}
+
+inline void cg_bind_vertex_attributes( const program_t& program )
+{
+	size_t attrib_size[] = { sizeof(vertex().pos), sizeof(vertex().norm), sizeof(vertex().tex) };
+	for( size_t k=0, byte_offset=0; k<3; k++, byte_offset+=attrib_size[k-1] )
+	{
+		GLint loc = program.vertex_attrib[k]; if(loc<0) continue;
+		cg_vertex_attrib_pointer( GLuint(loc), GLint(attrib_size[k]/sizeof(GLfloat)), sizeof(vertex), byte_offset );
+	}
+}
+
 inline void cg_bind_vertex_attributes( uint program, std::array<const char*,3> attrib_names={"position","normal","texcoord"} )
 {
 	size_t attrib_size[] = { sizeof(vertex().pos), sizeof(vertex().norm), sizeof(vertex().tex) };
 	for( size_t k=0, byte_offset=0; k<3; k++, byte_offset+=attrib_size[k-1] )
 	{
 		GLuint loc = glGetAttribLocation( program, attrib_names[k] ); if(loc>=3) continue;
-		glEnableVertexAttribArray( loc );
-		glVertexAttribPointer( loc, attrib_size[k]/sizeof(GLfloat), GL_FLOAT, GL_FALSE, sizeof(vertex), (GLvoid*) byte_offset );
+		cg_vertex_attrib_pointer( loc, GLint(attrib_size[k]/sizeof(GLfloat)), sizeof(vertex), byte_offset );
 	}
 }
 
@@ -3,10 +3,16 @@
 #define __CIRCLE_H__
 #include "cgmath.h"
 #include <queue>
-#include <mmsystem.h>
-#include <Windows.h>
-
-#pragma comment(lib, "winmm.lib")
+#if defined(_MSC_VER)
+	#include <Windows.h>
+	#include <mmsystem.h>
+	#pragma comment(lib, "winmm.lib")
+#else
+	// no audio outside Windows yet: the song is skipped and the game plays silent
+	#define TEXT(s)		s
+	#define SND_ASYNC	0
+	inline int sndPlaySound( const char*, unsigned ){ return 0; }
+#endif
 
 //*******************************************************************
 // common structures
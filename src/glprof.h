@@ -0,0 +1,197 @@
+//*******************************************************************
+// GL call counters and GPU timers for benchmarks and profiling overlays
+//*******************************************************************
+
+#ifndef __GLPROF_H__
+#define __GLPROF_H__
+
+#include "cgut.h"
+#include <algorithm>
+
+//*************************************
+// counts of the calls made through the hooked glad entry points
+struct gl_call_stats_t
+{
+	uint	calls=0;			// all hooked calls
+	uint	draws=0;			// draw calls
+	uint	state_changes=0;	// binds, enables and uniforms
+	uint	uploads=0;			// buffer and texture data specifications
+	uint	others=0;			// synchronization, mapping and the rest
+	static gl_call_stats_t& instance(){ static gl_call_stats_t s; return s; }
+	void reset(){ calls=draws=state_changes=uploads=others=0; }
+};
+
+// a hook counts the call and forwards it to the original glad pointer; ID tells entry points of the same type apart
+template <class PFN, int ID> struct gl_hook_t;
+template <class R, class... A, int ID> struct gl_hook_t<R(APIENTRY*)(A...),ID>
+{
+	typedef R(APIENTRY* pfn_t)(A...);
+	static pfn_t& original(){ static pfn_t p=nullptr; return p; }
+	static uint gl_call_stats_t::*& counter(){ static uint gl_call_stats_t::* c=nullptr; return c; }
+	static R APIENTRY hook( A... a ){ gl_call_stats_t& s=gl_call_stats_t::instance(); s.calls++; s.*counter() += 1; return original()(a...); }
+	static void install( pfn_t& slot, uint gl_call_stats_t::* c ){ if(original()||!slot) return; original()=slot; counter()=c; slot=hook; }
+	static void uninstall( pfn_t& slot ){ if(!original()) return; slot=original(); original()=nullptr; }
+};
+
+// hooked entry points and their counters
+#define GLPROF_ENTRY_POINTS(X) \
+	X(DrawArrays,draws) X(MultiDrawArrays,draws) X(DrawArraysInstanced,draws) X(DrawArraysInstancedBaseInstance,draws) \
+	X(DrawElements,draws) X(DrawElementsInstanced,draws) X(DrawElementsBaseVertex,draws) \
+	X(DrawElementsInstancedBaseVertex,draws) X(DrawElementsInstancedBaseVertexBaseInstance,draws) \
+	X(UseProgram,state_changes) X(BindVertexArray,state_changes) X(BindBuffer,state_changes) X(BindBufferRange,state_changes) \
+	X(BindTexture,state_changes) X(ActiveTexture,state_changes) X(Enable,state_changes) X(Disable,state_changes) \
+	X(BlendFunc,state_changes) X(PolygonMode,state_changes) X(Viewport,state_changes) \
+	X(Uniform1i,state_changes) X(Uniform1f,state_changes) X(Uniform2fv,state_changes) X(Uniform3fv,state_changes) \
+	X(Uniform4fv,state_changes) X(UniformMatrix4fv,state_changes) \
+	X(BufferData,uploads) X(BufferSubData,uploads) X(BufferStorage,uploads) \
+	X(TexImage2D,uploads) X(TexImage3D,uploads) X(TexSubImage2D,uploads) X(TexSubImage3D,uploads) \
+	X(MapBufferRange,others) X(FlushMappedBufferRange,others) X(FenceSync,others) X(ClientWaitSync,others) X(DeleteSync,others) \
+	X(PixelStorei,others) X(TexParameteri,others) X(Clear,others) \
+	X(VertexAttribPointer,others) X(EnableVertexAttribArray,others) X(VertexAttribDivisor,others)
+
+enum gl_entry_point_t
+{
+#define GLPROF_ENUM(name,counter) GLPROF_##name,
+	GLPROF_ENTRY_POINTS(GLPROF_ENUM)
+#undef GLPROF_ENUM
+};
+
+// swap the glad pointers of the entry points with the hooks; call after cg_init_extensions()
+inline void glprof_install()
+{
+#define GLPROF_INSTALL(name,counter) gl_hook_t<decltype(glad_gl##name),GLPROF_##name>::install( glad_gl##name, &gl_call_stats_t::counter );
+	GLPROF_ENTRY_POINTS(GLPROF_INSTALL)
+#undef GLPROF_INSTALL
+}
+
+inline void glprof_uninstall()
+{
+#define GLPROF_UNINSTALL(name,counter) gl_hook_t<decltype(glad_gl##name),GLPROF_##name>::uninstall( glad_gl##name );
+	GLPROF_ENTRY_POINTS(GLPROF_UNINSTALL)
+#undef GLPROF_UNINSTALL
+}
+
+//*************************************
+// GL_TIME_ELAPSED queries in a ring; results are read once available, so timing does not stall the pipeline
+struct gl_gpu_timer_t
+{
+	static const uint N = 8;
+	GLuint	queries[N] = {};
+	uint	issued=0, collected=0;		// queries ended so far, and results read so far
+	double	last_ms=0, total_ms=0;		// the latest result, and the sum of the results
+	uint	results=0;					// number of results in total_ms
+
+	void create(){ if(!queries[0]) glGenQueries( GLsizei(N), queries ); reset(); }
+	void release(){ if(queries[0]) glDeleteQueries( GLsizei(N), queries ); memset( queries, 0, sizeof(queries) ); }
+	void reset(){ last_ms=total_ms=0; results=0; }
+	void begin(){ if(issued-collected==N) collect( true ); glBeginQuery( GL_TIME_ELAPSED, queries[issued%N] ); }
+	void end(){ glEndQuery( GL_TIME_ELAPSED ); issued++; }
+	uint collect( bool wait=false );	// read the available results, or all of them with wait; returns the number read
+};
+
+inline uint gl_gpu_timer_t::collect( bool wait )
+{
+	uint n=0;
+	for( ; collected<issued; collected++, n++ )
+	{
+		GLuint q = queries[collected%N];
+		if(!wait){ GLint available=0; glGetQueryObjectiv( q, GL_QUERY_RESULT_AVAILABLE, &available ); if(!available) break; }
+		GLuint64 ns=0; glGetQueryObjectui64v( q, GL_QUERY_RESULT, &ns );
+		last_ms = double(ns)*1e-6; total_ms += last_ms; results++;
+	}
+	return n;
+}
+
+//*************************************
+// minimum, average and 99th percentile of the latest N samples, without allocations
+struct rolling_stat_t
+{
+	static const uint N = 240;
+	double	values[N];
+	double	scratch[N];
+	uint	count=0, next=0;
+
+	void add( double v ){ values[next]=v; next=(next+1)%N; if(count<N) count++; }
+	double minimum() const { double m=count?values[0]:0; for( uint k=1; k < count; k++ ) if(values[k]<m) m=values[k]; return m; }
+	double average() const { double s=0; for( uint k=0; k < count; k++ ) s+=values[k]; return count?s/count:0; }
+	double p99(){ if(!count) return 0; memcpy( scratch, values, sizeof(double)*count ); uint i=uint(0.99*(count-1)+0.5); std::nth_element( scratch, scratch+i, scratch+count ); return scratch[i]; }
+};
+
+//*************************************
+// input-to-photon latency: each traced event is followed from its capture through the tick that consumed it,
+// the frame that presented it and a GL_TIMESTAMP query behind that frame. times are in seconds on the caller's clock;
+// the GPU timestamps are moved onto it by the offset between the two clocks measured at the swap
+struct gl_latency_trace_t
+{
+	struct sample_t { double capture=0, consume=0, swap=0, gpu=0; uint tick=0, frame=~0u; };
+	struct query_t { GLuint query; uint frame; double offset; };	// offset: caller's clock minus GPU clock in seconds
+	static const uint N = 1024;		// latest samples kept for the percentiles
+	static const uint Q = 8;		// timestamp queries in flight
+	sample_t				samples[N];	// finished samples in a ring
+	uint					count=0, next=0, total=0;	// samples in the ring, the next slot, and samples finished so far
+	std::vector<sample_t>	inflight;	// consumed, and waiting for the swap or the timestamp
+	GLuint					queries[Q] = {};
+	query_t					pending[Q];	// issued queries, oldest first
+	uint					issued=0, collected=0;
+	double					sorted[N];	// scratch of percentile()
+
+	void create(){ if(!queries[0]) glGenQueries( GLsizei(Q), queries ); inflight.reserve(64); }
+	void release(){ if(queries[0]) glDeleteQueries( GLsizei(Q), queries ); memset( queries, 0, sizeof(queries) ); inflight.clear(); issued=collected=0; }
+	void consume( double capture, double now, uint tick ){ sample_t s; s.capture=capture; s.consume=now; s.tick=tick; inflight.push_back(s); }
+	void present( uint frame, double now );				// call right after the swap
+	void collect( bool wait=false );					// finish the samples of the available timestamps, or of all of them with wait
+	double percentile( double sample_t::* stage, double p );	// latency from the capture to a stage in seconds
+	void print();
+};
+
+inline void gl_latency_trace_t::present( uint frame, double now )
+{
+	bool any=false;
+	for( auto& s : inflight ) if(s.frame==~0u){ s.frame=frame; s.swap=now; any=true; }
+	if(!any||!queries[0]) return;
+	if(issued-collected==Q) collect( true );
+
+	// the timestamp is written once the GPU has finished all the commands before it, including this frame's
+	GLint64 gpu_now=0; glGetInteger64v( GL_TIMESTAMP, &gpu_now );
+	query_t& q = pending[issued%Q];
+	q = { queries[issued%Q], frame, now-double(gpu_now)*1e-9 };
+	glQueryCounter( q.query, GL_TIMESTAMP );
+	issued++;
+}
+
+inline void gl_latency_trace_t::collect( bool wait )
+{
+	for( ; collected<issued; collected++ )
+	{
+		const query_t& q = pending[collected%Q];
+		if(!wait){ GLint available=0; glGetQueryObjectiv( q.query, GL_QUERY_RESULT_AVAILABLE, &available ); if(!available) break; }
+		GLuint64 ns=0; glGetQueryObjectui64v( q.query, GL_QUERY_RESULT, &ns );
+		const double gpu = double(ns)*1e-9+q.offset;
+		for( size_t k=0; k < inflight.size(); )
+		{
+			if(inflight[k].frame!=q.frame){ k++; continue; }
+			inflight[k].gpu=gpu; samples[next]=inflight[k]; next=(next+1)%N; if(count<N) count++; total++;
+			inflight.erase(inflight.begin()+k);
+		}
+	}
+}
+
+inline double gl_latency_trace_t::percentile( double sample_t::* stage, double p )
+{
+	if(!count) return 0;
+	for( uint k=0; k < count; k++ ) sorted[k] = samples[k].*stage-samples[k].capture;
+	uint i = uint(p*(count-1)+0.5);
+	std::nth_element( sorted, sorted+i, sorted+count );
+	return sorted[i];
+}
+
+inline void gl_latency_trace_t::print()
+{
+	if(!count) return;
+	printf( "input latency (latest %u of %u events):\n  %-20s %8s %8s %8s\n", count, total, "ms", "p50", "p95", "p99" );
+	static const char* names[] = { "capture to tick", "capture to swap", "capture to GPU done" };
+	double sample_t::* stages[] = { &sample_t::consume, &sample_t::swap, &sample_t::gpu };
+	for( int k=0; k < 3; k++ ) printf( "  %-20s %8.2f %8.2f %8.2f\n", names[k], percentile(stages[k],0.5)*1000.0, percentile(stages[k],0.95)*1000.0, percentile(stages[k],0.99)*1000.0 );
+}
+
+#endif // __GLPROF_H__
@@ -1,46 +1,92 @@
+#include <chrono>			// standard headers come before cgmath.h, whose min/max macros break them
+#include <fstream>
+#include <future>
+#include <queue>
+#include <thread>
 #include "cgmath.h"			// slee's simple math library
 #include "cgut.h"			// slee's OpenGL utility
 #include "circle.h"			// circle class definition
-#include <fstream>
-#include <queue>
-#include<conio.h>
-#include <Windows.h>
+#include "glprof.h"			// GL call counters, GPU timers and latency traces
 #include<stdio.h>
 
 
 //*******************************************************************
 // forward declarations for freetype text
+bool text_prepare();
 void text_init();
-void render_text(std::string text, GLint x, GLint y, GLfloat scale, vec4 color);
+void text_finalize();
+void render_text(const char* text, GLint x, GLint y, GLfloat scale, vec4 color);
+uint hud_number_create(GLint x, GLint y, GLfloat scale, vec4 color);
+void render_hud_number(uint handle, int value);
+void flush_text();
+
+#ifdef _DEBUG
+//*******************************************************************
+// counting allocator to check that the text of a frame never allocates unless a new string is laid out;
+// only the render thread counts, and only while it submits and flushes the text
+static std::atomic<size_t>	heap_allocations{0};
+static thread_local bool	count_heap_allocations = false;
+void* operator new( size_t size ){ if(count_heap_allocations) heap_allocations++; if(void* p=malloc(size?size:1)) return p; throw std::bad_alloc(); }
+void operator delete( void* p ) noexcept { free(p); }
+#endif
 
 //*************************************
 // global constants
 static const char*	window_name = "Ddong Game";
 static const char*	vert_shader_path = "../bin/shaders/circ.vert";
 static const char*	frag_shader_path = "../bin/shaders/circ.frag";
-uint				NUM_TESS = 72 * 36 * 6;		// initial tessellation factor of the circle as a polygon
+static const char*	chart_path = "map.txt";
+static const double	tick_rate = 200.0;		// simulation ticks per second; the chart and the song are timed for it
+static const double	max_catch_up = 0.25;	// seconds of simulation run at most per frame, so a long stall does not freeze the game
+static const float	snap_distance = 20.0f;	// jumps longer than this (recycled steps) are not interpolated
+static const double	input_interval = 0.001;	// seconds between the samples of the input thread
 
 //*************************************
 // window objects
 GLFWwindow*	window = nullptr;
 ivec2		window_size = ivec2( 1024, 576 );	// initial window size
+std::atomic<uint>	resized_size{0};		// the latest size from reshape(), packed as (width<<16)|height; applied by the render thread
 
 //*************************************
 // OpenGL objects
-GLuint	program			= 0;	// ID holder for GPU program
-GLuint	vertex_buffer	= 0;	// ID holder for vertex buffer
-GLuint	index_buffer	= 0;	// ID holder for index buffer
+program_t	program;			// GPU program with its reflected locations
+gl_buffer_t	vertex_buffer;		// vertex buffer of all the meshes
+gl_buffer_t	index_buffer;		// index buffer of all the meshes
+gl_ring_buffer_t	frame_ring;		// per-frame data of the scene and text renderers
+GLuint	vertex_array	= 0;	// ID holder for vertex array of the scene
  
 //*************************************
 // global variables
 int		frame = 0;						// index of rendering frames
+std::chrono::steady_clock::time_point	launch_time;	// for the time to the first frame
+uint	attrib_pointer_calls = 0;		// vertex attribute specifications made by user_init()
 float	t = 0.0f;						// current simulation parameter
 int		color = 0;			// use circle's color?
 bool	b_index_buffer = true;			// use index buffering?
+bool	b_sdf_text = false;				// render text from a signed distance field atlas?
 bool	b_wireframe = false;
 bool	rotating = true;
 bool	start = false;
 bool	quit = false;
+std::atomic<bool>	b_latency_overlay{false};	// show the input latency percentiles? (F2; toggled by the input thread)
+frame_pacer_t	pacer;					// paces the frame loop by vsync, a deadline, or not at all
+gl_latency_trace_t	latency;			// key presses from their capture to the GPU finishing the frame that showed them
+char	latency_text[2][64] = {};		// overlay lines, refreshed twice a second
+bool	b_profiler_overlay = false;		// show the frame profiler? (F3; owned by the render thread)
+std::atomic<bool>	profiler_toggled{false};	// F3 pressed; render() applies it at the start of the next frame
+
+//*************************************
+// frame profiler: CPU time of the stages of a frame, GPU time of the passes, and GL call counts of the last frame
+enum { STAGE_SIM, STAGE_UPDATE, STAGE_SCENE, STAGE_TEXT, STAGE_SWAP, STAGE_COUNT };
+static const char*	stage_names[STAGE_COUNT] = { "sim", "update", "scene", "text", "swap" };
+struct
+{
+	rolling_stat_t	cpu[STAGE_COUNT];		// in ms
+	rolling_stat_t	gpu_scene, gpu_text;	// in ms; sampled while the overlay is shown
+	gl_gpu_timer_t	scene_timer, text_timer;
+	uint	calls=0, draws=0, state_changes=0;	// counted while the overlay is shown
+	char	lines[STAGE_COUNT+4][64] = {};
+} profiler;
 std::queue<int>	map;
 int	map_size = 0;
 
@@ -48,10 +94,62 @@ std::vector<step_t>	steps;
 auto	main_cube = std::move(create_cube());
 struct { bool add=false, sub=false; operator bool() const { return add||sub; } } b; // flags of keys for smooth changes
 
+//*************************************
+// fixed-timestep simulation: render() interpolates between the states of the last two ticks
+struct sim_state_t
+{
+	vec3	cube_center;
+	float	cube_angle = 0.0f;
+	float	eye_x = 0.0f, at_x = 0.0f;
+	std::vector<vec3>	step_centers;	// sized once per game; capturing does not allocate afterwards
+};
+sim_state_t	prev_state, curr_state;
+double		sim_time = 0.0;			// time simulated up to
+double		sim_alpha = 0.0;		// fraction of a tick between curr_state and the present
+uint		tick_count = 0;			// ticks simulated so far
+
+//*************************************
+// key events from the GLFW callbacks, applied by the simulation at the tick they fall in
+struct input_event_t
+{
+	double	time;		// seconds since launch_time on the steady clock
+	int		key, action, mods;
+};
+spsc_queue_t<input_event_t,256>	input_queue;
+
+// keys of the gamepad buttons in GLFW's standard layout, and of the first buttons of other joysticks
+static const int gamepad_keys[GLFW_GAMEPAD_BUTTON_LAST+1] =
+{
+	GLFW_KEY_SPACE, GLFW_KEY_UNKNOWN, GLFW_KEY_UNKNOWN, GLFW_KEY_UNKNOWN,	// A, B, X, Y
+	GLFW_KEY_LEFT, GLFW_KEY_RIGHT, GLFW_KEY_HOME, GLFW_KEY_R,				// bumpers, back, start
+	GLFW_KEY_UNKNOWN, GLFW_KEY_UNKNOWN, GLFW_KEY_UNKNOWN,					// guide, thumbs
+	GLFW_KEY_UNKNOWN, GLFW_KEY_RIGHT, GLFW_KEY_UNKNOWN, GLFW_KEY_LEFT		// d-pad up, right, down, left
+};
+static const int joystick_keys[] = { GLFW_KEY_SPACE, GLFW_KEY_LEFT, GLFW_KEY_RIGHT, GLFW_KEY_R };
+unsigned char	joystick_buttons[GLFW_JOYSTICK_LAST+1][GLFW_GAMEPAD_BUTTON_LAST+1] = {};	// button states of the previous sample
+
 //*************************************
 // holder of vertices and indices of a unit circle
 std::vector<vertex>	unit_cube_vertices;	// host-side vertices
+mesh_registry		meshes;				// draw ranges of the meshes in the shared buffers
+uint				cube_mesh = 0;		// mesh handle of the unit cube
+uint				score_number = 0;	// HUD number handle of the score
+
+//*************************************
+// per-instance attributes of the scene program
+struct instance_t
+{
+	mat4	model_matrix;	// modeling transformation (row-major)
+	vec4	color;			// RGBA color in [0,1]
+};
+
 
+//*************************************
+// locations of the scene program, resolved once after linking
+struct
+{
+	GLint	instance_matrix = -1, instance_color = -1;
+} scene_loc;
 
 //*******************************************************************
 // scene object
@@ -61,14 +159,18 @@ camera		cam;
 //*************************************
 void update()
 {
+	// apply the size from the input thread
+	const uint size = resized_size.load();
+	if(size && ivec2(int(size>>16),int(size&0xffff))!=window_size)
+	{
+		window_size = ivec2(int(size>>16),int(size&0xffff));
+		glViewport( 0, 0, window_size.x, window_size.y );
+	}
+
 	// update projection matrix
 	cam.aspect_ratio = window_size.x / float(window_size.y);
 	cam.projection_matrix = mat4::perspective(cam.fovy, cam.aspect_ratio, cam.dnear, cam.dfar);
 
-	float t = float(glfwGetTime());
-	float scale = 1.0f + float(cos(t * 1.5f)) * 0.05f;
-	mat4 model_matrix = mat4::scale(scale, scale, scale);
-
 	// tricky aspect correction matrix for non-square window
 	float aspect = window_size.x/float(window_size.y);
 	mat4 aspect_matrix =
@@ -78,20 +180,154 @@ void update()
 		0, 0, 1, 0,
 		0, 0, 0, 1
 	};
+}
 
-	// update common uniform variables in vertex/fragment shaders
-	GLint uloc;
-	uloc = glGetUniformLocation(program, "view_matrix");			if (uloc > -1) glUniformMatrix4fv(uloc, 1, GL_TRUE, cam.view_matrix);
-	uloc = glGetUniformLocation(program, "projection_matrix");	if (uloc > -1) glUniformMatrix4fv(uloc, 1, GL_TRUE, cam.projection_matrix);
-	uloc = glGetUniformLocation(program, "model_matrix");			if (uloc > -1) glUniformMatrix4fv(uloc, 1, GL_TRUE, model_matrix);
+void bind_instance_attributes( size_t byte_offset=0 )
+{
+	// a mat4 attribute takes four consecutive locations, one per row
+	glBindBuffer( GL_ARRAY_BUFFER, frame_ring.buffer );
+	GLint loc = scene_loc.instance_matrix;
+	if(loc>-1) for( GLuint k=0; k<4; k++ ) cg_vertex_attrib_pointer( loc+k, 4, sizeof(instance_t), byte_offset+sizeof(vec4)*k, 1 );
+	loc = scene_loc.instance_color;
+	if(loc>-1) cg_vertex_attrib_pointer( loc, 4, sizeof(instance_t), byte_offset+sizeof(mat4), 1 );
+}
+
+double now_seconds()
+{
+	// the clock of the simulation and the input stamps
+	return std::chrono::duration<double>(std::chrono::steady_clock::now()-launch_time).count();
+}
+
+void apply_input( const input_event_t& e );
+
+void capture_state( sim_state_t& s )
+{
+	s.cube_center = main_cube.center;
+	s.cube_angle = main_cube.angle;
+	s.eye_x = cam.eye.x; s.at_x = cam.at.x;
+	s.step_centers.resize(steps.size());
+	for (size_t k = 0; k < steps.size(); k++) s.step_centers[k] = steps[k].center;
+}
+
+void tick()
+{
+	// one step of the game at tick_rate
+	if (!start) return;
+	t += float(1.0 / tick_rate);
+	float tmp = main_cube.roll(&steps, &map, &start);
+	cam.eye.x = -100 + tmp;
+	cam.at.x = tmp;
+}
+
+void simulate()
+{
+	// run the ticks that are due; the remainder carries over to the next frame
+	const double dt = 1.0 / tick_rate, now = now_seconds();
+	if (now - sim_time > max_catch_up) sim_time = now - max_catch_up;
+	while (sim_time + dt <= now)
+	{
+		// the events that happened up to the end of this tick take effect before it
+		input_event_t e;
+		while (input_queue.peek(e) && e.time <= sim_time + dt)
+		{
+			input_queue.pop(e);
+			if (e.action == GLFW_PRESS) latency.consume(e.time, now_seconds(), tick_count);	// wall time: ticks run in a burst at the start of the frame
+			apply_input(e);
+		}
+		if (sim_time + dt > now) break;	// an event restarted the game
+
+		tick();
+		tick_count++;
+		std::swap(prev_state, curr_state);
+		capture_state(curr_state);
+		sim_time += dt;
+	}
+	sim_alpha = (now - sim_time) / dt;
+}
+
+inline float blend( float a, float b, float alpha ){ return fabs(b-a)>snap_distance ? b : a+(b-a)*alpha; }
+inline vec3 blend( const vec3& a, const vec3& b, float alpha ){ return vec3( blend(a.x,b.x,alpha), blend(a.y,b.y,alpha), blend(a.z,b.z,alpha) ); }
+
+void refresh_profiler_text()
+{
+	const auto row = [](char* line, const char* name, rolling_stat_t& r) { snprintf(line, 64, "%-10s %6.2f %6.2f %6.2f", name, r.minimum(), r.average(), r.p99()); };
+	snprintf(profiler.lines[0], 64, "%-10s %6s %6s %6s", "ms", "min", "avg", "p99");
+	for (int k = 0; k < STAGE_COUNT; k++) row(profiler.lines[k + 1], stage_names[k], profiler.cpu[k]);
+	row(profiler.lines[STAGE_COUNT + 1], "gpu scene", profiler.gpu_scene);
+	row(profiler.lines[STAGE_COUNT + 2], "gpu text", profiler.gpu_text);
+	snprintf(profiler.lines[STAGE_COUNT + 3], 64, "draws %u  states %u  calls %u", profiler.draws, profiler.state_changes, profiler.calls);
 }
 
 void render()
 {
+	// toggle the profiler between frames; GL calls are counted only while it is shown, since the hooks add an indirection to every call
+	if (profiler_toggled.exchange(false))
+	{
+		b_profiler_overlay = !b_profiler_overlay;
+		if (b_profiler_overlay) glprof_install(); else glprof_uninstall();
+	}
+
+	// start writing this frame's data into the ring
+	const double render_begin = now_seconds();
+	gl_call_stats_t::instance().reset();
+	frame_ring.begin_frame();
+
 	// clear screen (with background color) and clear depth buffer
 	glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
 
+	// interpolate the presentation between the last two ticks
+	const float alpha = float(sim_alpha);
+	if (start) {
+		vec3 eye = cam.eye, at = cam.at;
+		eye.x = blend(prev_state.eye_x, curr_state.eye_x, alpha);
+		at.x = blend(prev_state.at_x, curr_state.at_x, alpha);
+		cam.view_matrix = mat4::look_at(eye, at, cam.up);
+	}
+
+	// write per-instance attributes straight into the ring: main cube first, and then steps.
+	// they are reserved ahead of the text, so that they start the region even without persistent mapping
+	size_t instance_offset = 0;
+	GLsizei instance_count = GLsizei(steps.size()+1);
+	instance_t* instance = (instance_t*) frame_ring.alloc( sizeof(instance_t)*instance_count, sizeof(instance_t), instance_offset );
+	cube_t cube = main_cube;
+	cube.center = blend(prev_state.cube_center, curr_state.cube_center, alpha);
+	cube.angle = prev_state.cube_angle + (curr_state.cube_angle - prev_state.cube_angle)*alpha;
+	cube.update(t);
+	if(instance) *instance++ = { cube.model_matrix, cube.color };
+	for (size_t k = 0; k < steps.size(); k++) {
+		steps[k].update(t);	// statuses changed by keys show at once; only the motion is interpolated
+		step_t s = steps[k];
+		if (k < curr_state.step_centers.size()) s.center = blend(prev_state.step_centers[k], curr_state.step_centers[k], alpha);
+		s.update(t);
+		if(instance) *instance++ = { s.model_matrix, s.color };
+	}
+	frame_ring.commit();
+	cg_bind_frame_block( frame_ring, cam.view_matrix, cam.projection_matrix, window_size, t );
+	double scene_seconds = now_seconds() - render_begin;
+
+	// refresh the latency overlay; sorting for the percentiles stays out of the per-frame path
+	static double latency_refresh = 0.0;
+	if (b_latency_overlay && glfwGetTime() >= latency_refresh)
+	{
+		latency_refresh = glfwGetTime() + 0.5;
+		double gl_latency_trace_t::sample_t::* swap = &gl_latency_trace_t::sample_t::swap, gl_latency_trace_t::sample_t::* gpu = &gl_latency_trace_t::sample_t::gpu;
+		snprintf(latency_text[0], sizeof(latency_text[0]), "swap p50 %.1f p99 %.1f ms", latency.percentile(swap, 0.5) * 1000.0, latency.percentile(swap, 0.99) * 1000.0);
+		snprintf(latency_text[1], sizeof(latency_text[1]), "gpu  p50 %.1f p99 %.1f ms (%u)", latency.percentile(gpu, 0.5) * 1000.0, latency.percentile(gpu, 0.99) * 1000.0, latency.count);
+	}
+
+	// refresh the profiler overlay with the rolling statistics of the earlier frames
+	static double profiler_refresh = 0.0;
+	if (b_profiler_overlay && glfwGetTime() >= profiler_refresh) { profiler_refresh = glfwGetTime() + 0.5; refresh_profiler_text(); }
+
 	// render texts
+	const double text_begin = now_seconds();
+	if (b_profiler_overlay) profiler.text_timer.begin();
+#ifdef _DEBUG
+	extern uint text_layouts_built;
+	const size_t allocations = heap_allocations;
+	const uint layouts_built = text_layouts_built;
+	count_heap_allocations = true;
+#endif
 	if (!start) {
 		render_text("Ddong Game!", 100, 100, 1.0f, vec4(0.9f, 0.9f, 0.9f, 1.0f));
 		render_text("Press right when floor is green", 100, 140, 0.5f, vec4(50 / 255.0f, 120 / 225.0f, 20 / 225.0f, 0.7f));
@@ -101,187 +337,220 @@ void render()
 		render_text("Press any Q to quit", 100, 550, 0.5f, vec4(0.9f, 0.9f, 0.9f, 1.0f));
 	}
 	render_text("Score:", 800, 520, 0.5f, vec4(107 / 255.0f, 236 / 225.0f, 219 / 225.0f, 1.0f));
-	render_text(std::to_string(main_cube.score), 900, 520, 0.5f, vec4(107 / 255.0f, 236 / 225.0f, 219 / 225.0f, 1.0f));
-
-	// notify GL that we use our own program and buffers
+	if (b_latency_overlay) {
+		render_text(latency_text[0], 10, 24, 0.4f, vec4(1.0f, 1.0f, 0.6f, 1.0f));
+		render_text(latency_text[1], 10, 46, 0.4f, vec4(1.0f, 1.0f, 0.6f, 1.0f));
+	}
+	if (b_profiler_overlay) {
+		for (int k = 0; k < STAGE_COUNT + 4; k++) render_text(profiler.lines[k], 10, 80 + k * 18, 0.35f, vec4(0.7f, 1.0f, 0.7f, 1.0f));
+	}
+	render_hud_number(score_number, main_cube.score);
+	flush_text();	// one multi-draw for the retained strings, and one draw for the rest
+#ifdef _DEBUG
+	count_heap_allocations = false;
+	// a frame that lays out a new string may allocate for its layout; a frame of retained text must not
+	assert( (heap_allocations==allocations || text_layouts_built!=layouts_built) && "HUD text allocated in a frame without new layouts" );
+#endif
+	if (b_profiler_overlay) profiler.text_timer.end();
+
+	profiler.cpu[STAGE_TEXT].add((now_seconds() - text_begin) * 1000.0);
+
+	// notify GL that we use our own program and vertex array
+	const double draw_begin = now_seconds();
+	if (b_profiler_overlay) profiler.scene_timer.begin();
 	glUseProgram( program );
-	if(vertex_buffer)	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-	if(index_buffer)	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+	glBindVertexArray( vertex_array );
 
-	// bind vertex attributes to your shader program
-	cg_bind_vertex_attributes( program );
-	
-	if (start) {
-	
-		t += 0.005f;
-		float tmp = main_cube.roll(&steps, &map, &start);
-		cam.eye.x = -100 + tmp;
-		cam.at.x = tmp;
-		cam.view_matrix = mat4::look_at(cam.eye, cam.at, cam.up);
+	// without base instances (before GL 4.2), the instance attributes follow the offset instead; rare, since the persistent ring needs GL 4.4
+	GLuint base_instance = GLuint(instance_offset/sizeof(instance_t));
+	static size_t instance_attrib_offset = 0;
+	if(!gl_extensions_t::instance().base_instance && instance && instance_offset!=instance_attrib_offset)
+	{
+		bind_instance_attributes( instance_attrib_offset=instance_offset );
+		attrib_pointer_calls = cg_attrib_pointer_count();
 	}
+	if(!gl_extensions_t::instance().base_instance) base_instance = 0;
 
-	main_cube.update(t);
-	// update per-circle uniforms
-	GLint uloc;
-	uloc = glGetUniformLocation(program, "solid_color");		if (uloc > -1) glUniform4fv(uloc, 1, main_cube.color);	// pointer version
-	uloc = glGetUniformLocation(program, "model_matrix");		if (uloc > -1) glUniformMatrix4fv(uloc, 1, GL_TRUE, main_cube.model_matrix);
+	// a single draw call for the cube and all the steps
+	if(instance) meshes.draw( cube_mesh, instance_count, b_index_buffer, base_instance );
+	glBindVertexArray( 0 );
+	if (b_profiler_overlay) profiler.scene_timer.end();
+	scene_seconds += now_seconds() - draw_begin;
+	profiler.cpu[STAGE_SCENE].add(scene_seconds * 1000.0);
 
-	// per-circle draw calls
-	if (b_index_buffer)	glDrawElements(GL_TRIANGLES, NUM_TESS, GL_UNSIGNED_INT, nullptr);
-	else				glDrawArrays(GL_TRIANGLES, 0, NUM_TESS); // NUM_TESS = N
+	// vertex arrays are built once; no attribute should be respecified while rendering
+	assert( cg_attrib_pointer_count()==attrib_pointer_calls && "vertex attributes respecified per frame" );
+	frame++;
 
-	for (auto& c : steps) {
-		c.update(t);
-
-		// update per-circle uniforms
-		GLint uloc;
-		uloc = glGetUniformLocation(program, "solid_color");		if (uloc > -1) glUniform4fv(uloc, 1, c.color);	// pointer version
-		uloc = glGetUniformLocation(program, "model_matrix");		if (uloc > -1) glUniformMatrix4fv(uloc, 1, GL_TRUE, c.model_matrix);
-
-		// per-circle draw calls
-		if (b_index_buffer)	glDrawElements(GL_TRIANGLES, NUM_TESS, GL_UNSIGNED_INT, nullptr);
-		else				glDrawArrays(GL_TRIANGLES, 0, NUM_TESS); // NUM_TESS = N
-	}
+	// fence this frame's region of the ring
+	frame_ring.end_frame();
 
 	// swap front and back buffers, and display to screen
+	const double swap_begin = now_seconds();
 	glfwSwapBuffers( window );
+	const double swap_end = now_seconds();
+	profiler.cpu[STAGE_SWAP].add((swap_end - swap_begin) * 1000.0);
+	latency.present( uint(frame), swap_end );
+	latency.collect();
+
+	// read the GPU times of the earlier frames that are ready, and the call counts of this one
+	if (profiler.scene_timer.collect()) profiler.gpu_scene.add(profiler.scene_timer.last_ms);
+	if (profiler.text_timer.collect()) profiler.gpu_text.add(profiler.text_timer.last_ms);
+	const gl_call_stats_t& calls = gl_call_stats_t::instance();
+	profiler.calls = calls.calls; profiler.draws = calls.draws; profiler.state_changes = calls.state_changes;
+	if(frame==1) printf( "time to first frame: %.1f ms\n", std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-launch_time).count() );
 }
 
 void reshape( GLFWwindow* window, int width, int height )
 {
 	// set current viewport in pixels (win_x, win_y, win_width, win_height)
 	// viewport: the window area that are affected by rendering 
-	window_size = ivec2(width,height);
-	glViewport( 0, 0, width, height );
+	// the context belongs to the render thread, which applies the size in update()
+	resized_size.store( (uint(width)<<16)|uint(height&0xffff) );
 }
 
-std::vector<vertex> create_cube_verticese(uint N, cube_t main_cube, std::vector<step_t> steps) {
-	std::vector<vertex> v;	// origin
-	
-	// Main cube
-	v.push_back({ vec3(-1.0f, -1.0f, -1.0f), vec3(1,0,0)});
-	v.push_back({ vec3(1.0f, -1.0f, -1.0f), vec3(1,0,0)});
-	v.push_back({ vec3(-1.0f, 1.0f, -1.0f), vec3(1,0,0)});;
-	v.push_back({ vec3(1.0f, 1.0f, -1.0f), vec3(1,0,0)});
-	v.push_back({ vec3(-1.0f, -1.0f, 1.0f), vec3(1,0,0)});
-	v.push_back({ vec3(1.0f, -1.0f, 1.0f), vec3(1,0,0)});
-	v.push_back({ vec3(-1.0f, 1.0f, 1.0f), vec3(1,0,0)});
-	v.push_back({ vec3(1.0f, 1.0f, 1.0f), vec3(1,0,0)});
-
-	for (auto c : steps) {
-		v.push_back({ vec3(-1.0f, -1.0f, -1.0f), vec3(1,0,0), vec2(1.0f, 1.0f) });
-		v.push_back({ vec3(1.0f, -1.0f, -1.0f), vec3(1,0,0), vec2(1.0f, 0.9f) });
-		v.push_back({ vec3(-1.0f, 1.0f, -1.0f), vec3(1,0,0), vec2(1.0f, 0.8f) });;
-		v.push_back({ vec3(1.0f, 1.0f, -1.0f), vec3(1,0,0), vec2(1.0f, 0.7f) });
-		v.push_back({ vec3(-1.0f, -1.0f, 1.0f), vec3(1,0,0), vec2(1.0f, 0.6f) });
-		v.push_back({ vec3(1.0f, -1.0f, 1.0f), vec3(1,0,0), vec2(1.0f, 0.5f) });
-		v.push_back({ vec3(-1.0f, 1.0f, 1.0f), vec3(1,0,0), vec2(1.0f, 0.4f) });
-		v.push_back({ vec3(1.0f, 1.0f, 1.0f), vec3(1,0,0), vec2(1.0f, 0.3f) });
+void poll_joysticks()
+{
+	// sample the buttons of every joystick, and queue their transitions as key events
+	const double now = now_seconds();
+	for( int jid=GLFW_JOYSTICK_1; jid<=GLFW_JOYSTICK_LAST; jid++ )
+	{
+		unsigned char* last = joystick_buttons[jid];
+		const unsigned char* buttons = nullptr; int count = 0;
+		const int* keys = joystick_keys; int key_count = int(sizeof(joystick_keys)/sizeof(joystick_keys[0]));
+		GLFWgamepadstate pad;
+		if(glfwJoystickIsGamepad(jid)&&glfwGetGamepadState(jid,&pad)){ buttons=pad.buttons; count=GLFW_GAMEPAD_BUTTON_LAST+1; keys=gamepad_keys; key_count=count; }
+		else if(glfwJoystickPresent(jid)) buttons = glfwGetJoystickButtons(jid,&count);
+		count = min(count,key_count);
+		for( int k=0; k < key_count; k++ )
+		{
+			const unsigned char state = k<count ? buttons[k] : GLFW_RELEASE;	// a disconnected joystick releases its buttons
+			if(state==last[k]) continue;
+			last[k] = state;
+			if(keys[k]!=GLFW_KEY_UNKNOWN) input_queue.push({ now, keys[k], state==GLFW_PRESS?GLFW_PRESS:GLFW_RELEASE, 0 });
+		}
 	}
-	return v;
 }
 
-void update_vertex_buffer( const std::vector<vertex>& vertices, uint N , std::vector<step_t> steps, cube_t main_cube)
+std::vector<vertex> create_cube_vertices()
 {
-	// clear and create new buffers
-	if(vertex_buffer)	glDeleteBuffers( 1, &vertex_buffer );	vertex_buffer = 0;
-	if(index_buffer)	glDeleteBuffers( 1, &index_buffer );	index_buffer = 0;
+	// the cube and the steps share a unit cube; its texcoords color the main cube
+	return
+	{
+		{ vec3(-1.0f, -1.0f, -1.0f), vec3(1,0,0), vec2(1.0f, 1.0f) },
+		{ vec3(1.0f, -1.0f, -1.0f), vec3(1,0,0), vec2(1.0f, 0.9f) },
+		{ vec3(-1.0f, 1.0f, -1.0f), vec3(1,0,0), vec2(1.0f, 0.8f) },
+		{ vec3(1.0f, 1.0f, -1.0f), vec3(1,0,0), vec2(1.0f, 0.7f) },
+		{ vec3(-1.0f, -1.0f, 1.0f), vec3(1,0,0), vec2(1.0f, 0.6f) },
+		{ vec3(1.0f, -1.0f, 1.0f), vec3(1,0,0), vec2(1.0f, 0.5f) },
+		{ vec3(-1.0f, 1.0f, 1.0f), vec3(1,0,0), vec2(1.0f, 0.4f) },
+		{ vec3(1.0f, 1.0f, 1.0f), vec3(1,0,0), vec2(1.0f, 0.3f) },
+	};
+}
 
+void update_vertex_buffer( const std::vector<vertex>& vertices )
+{
 	// check exceptions
 	if(vertices.empty()){ printf("[error] vertices is empty.\n"); return; }
 
-	int cube_number = steps.size();
-	// create buffers
-	for (int ccount=0;ccount<=cube_number;ccount++)
+	// indices of a unit cube, relative to its own eight vertices
+	static const uint cube_indices[] =
 	{
-		std::vector<uint> indices;
-
-		indices.push_back(ccount * 8 + 1);
-		indices.push_back(ccount * 8 + 0);
-		indices.push_back(ccount * 8 + 2);
-		indices.push_back(ccount * 8 + 1);
-		indices.push_back(ccount * 8 + 2);
-		indices.push_back(ccount * 8 + 3);
-		
-		indices.push_back(ccount * 8 + 0);
-		indices.push_back(ccount * 8 + 4);
-		indices.push_back(ccount * 8 + 2);
-		indices.push_back(ccount * 8 + 4);
-		indices.push_back(ccount * 8 + 6);
-		indices.push_back(ccount * 8 + 2);
-		
-		indices.push_back(ccount * 8 + 2);
-		indices.push_back(ccount * 8 + 6);
-		indices.push_back(ccount * 8 + 3);
-		indices.push_back(ccount * 8 + 6);
-		indices.push_back(ccount * 8 + 7);
-		indices.push_back(ccount * 8 + 3);
-		
-		indices.push_back(ccount * 8 + 3);
-		indices.push_back(ccount * 8 + 7);
-		indices.push_back(ccount * 8 + 1);
-		indices.push_back(ccount * 8 + 7);
-		indices.push_back(ccount * 8 + 5);
-		indices.push_back(ccount * 8 + 1);
-		
-		indices.push_back(ccount * 8 + 1);
-		indices.push_back(ccount * 8 + 5);
-		indices.push_back(ccount * 8 + 4);
-		indices.push_back(ccount * 8 + 1);
-		indices.push_back(ccount * 8 + 4);
-		indices.push_back(ccount * 8 + 0);
-
-		indices.push_back(ccount * 8 + 4);
-		indices.push_back(ccount * 8 + 5);
-		indices.push_back(ccount * 8 + 6);
-		indices.push_back(ccount * 8 + 6);
-		indices.push_back(ccount * 8 + 5);
-		indices.push_back(ccount * 8 + 7);
-		
-
-		// generation of vertex buffer: use vertices as it is
-		glGenBuffers( 1, &vertex_buffer );
-		glBindBuffer( GL_ARRAY_BUFFER, vertex_buffer );
-		glBufferData( GL_ARRAY_BUFFER, sizeof(vertex)*vertices.size(), &vertices[0], GL_STATIC_DRAW);
-
-		// geneation of index buffer
-		glGenBuffers( 1, &index_buffer );
-		glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, index_buffer );
-		glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof(uint)*indices.size(), &indices[0], GL_STATIC_DRAW );
+		1, 0, 2,	1, 2, 3,
+		0, 4, 2,	4, 6, 2,
+		2, 6, 3,	6, 7, 3,
+		3, 7, 1,	7, 5, 1,
+		1, 5, 4,	1, 4, 0,
+		4, 5, 6,	6, 5, 7,
+	};
+
+	// register the meshes, and then upload the shared buffers only once
+	std::vector<vertex> vertex_list;
+	std::vector<uint> index_list;
+	meshes.clear();
+	cube_mesh = meshes.add( vertex_list, index_list, &vertices[0], GLuint(vertices.size()), cube_indices, sizeof(cube_indices)/sizeof(uint) );
+
+	// generation of vertex buffer: use vertices as it is
+	vertex_buffer.create( GL_ARRAY_BUFFER );
+	vertex_buffer.data( &vertex_list[0], sizeof(vertex)*vertex_list.size() );
+
+	// geneation of index buffer
+	index_buffer.create( GL_ELEMENT_ARRAY_BUFFER );
+	index_buffer.data( &index_list[0], sizeof(uint)*index_list.size() );
+}
+
+
+std::queue<int> parse_chart( const char* path )
+{
+	// no shared state, so that a worker thread can parse the chart
+	std::ifstream in(path);
+	std::string s;
+	std::queue<int> chart;
+
+	for (int k = 0; k < 1000 && !in.eof(); k++) {
+		in >> s;
+		chart.push(stoi(s));
 	}
+	return chart;
 }
 
+void game_reset( std::queue<int> chart )
+{
+	// reset only the game state; the context, programs, buffers and fonts stay alive
+	sndPlaySound(0, 0);
+	map = std::move(chart);
+	map_size = int(map.size());
+	steps = std::move(create_steps());
+	main_cube = std::move(create_cube());
+	cam = camera();
+	t = 0.0f;
+
+	// start the ticks afresh, with nothing to interpolate from
+	capture_state(curr_state);
+	prev_state = curr_state;
+	sim_time = now_seconds();
+	sim_alpha = 0.0;
+}
 
-void keyboard( GLFWwindow* window, int key, int scancode, int action, int mods )
+void apply_input( const input_event_t& e )
 {
-	if(action==GLFW_PRESS)
+	if(e.action==GLFW_PRESS)
 	{
 		start = true;
-		if (key == GLFW_KEY_ESCAPE || key == GLFW_KEY_Q)	exit(0);
-		else if (key == GLFW_KEY_R) glfwSetWindowShouldClose(window, GL_TRUE);
-		else if (key == GLFW_KEY_HOME) {
+		if (e.key == GLFW_KEY_R) game_reset(parse_chart(chart_path));
+		else if (e.key == GLFW_KEY_HOME) {
 			cam.eye = vec3(-150, -200, 0);
 			cam.at = vec3(0, 0, 0);
 			cam.up = vec3(0, 0, 1);
 			cam.view_matrix = mat4::look_at(cam.eye, cam.at, cam.up);
 		}
-		else if (key == GLFW_KEY_RIGHT) {
+		else if (e.key == GLFW_KEY_RIGHT) {
 			steps.at(main_cube.next_index).angle_status++;
 		}
-		else if (key == GLFW_KEY_LEFT) {
+		else if (e.key == GLFW_KEY_LEFT) {
 			steps.at(main_cube.next_index).angle_status--;
 		}
-		else if (key == GLFW_KEY_SPACE) {
+		else if (e.key == GLFW_KEY_SPACE) {
 			steps.at(main_cube.next_index + 8).box_status--;
 		}
 	}
-	else if(action==GLFW_RELEASE)
+	else if(e.action==GLFW_RELEASE)
 	{
-		if(key==GLFW_KEY_KP_ADD||(key==GLFW_KEY_EQUAL&&(mods&GLFW_MOD_SHIFT)))	b.add = false;
-		else if(key==GLFW_KEY_KP_SUBTRACT||key==GLFW_KEY_MINUS) b.sub = false;
+		if(e.key==GLFW_KEY_KP_ADD||(e.key==GLFW_KEY_EQUAL&&(e.mods&GLFW_MOD_SHIFT)))	b.add = false;
+		else if(e.key==GLFW_KEY_KP_SUBTRACT||e.key==GLFW_KEY_MINUS) b.sub = false;
 	}
 }
 
+void keyboard( GLFWwindow* window, int key, int scancode, int action, int mods )
+{
+	// stamp the event now, and leave the game state to the simulation
+	if (action == GLFW_PRESS && (key == GLFW_KEY_ESCAPE || key == GLFW_KEY_Q)) { glfwSetWindowShouldClose(window, GL_TRUE); return; }	// leave the loop, so the pacing report and the cleanup run
+	if (action == GLFW_REPEAT) return;
+	if (action == GLFW_PRESS && key == GLFW_KEY_F2) { b_latency_overlay = !b_latency_overlay.load(); return; }	// debug keys never reach the game
+	if (action == GLFW_PRESS && key == GLFW_KEY_F3) { profiler_toggled = true; return; }
+	if (!input_queue.push({ now_seconds(), key, action, mods })) printf("warning: input queue is full; a key event is dropped\n");
+}
+
 void mouse( GLFWwindow* window, int button, int action, int mods )
 {
 }
@@ -292,9 +561,12 @@ void motion(GLFWwindow* window, double x, double y)
 
 bool user_init()
 {
-	main_cube = std::move(create_cube());
 	window_size = ivec2(1024, 576);
 
+	// resolve the locations used every frame
+	scene_loc.instance_matrix = program.attribute("instance_matrix");
+	scene_loc.instance_color = program.attribute("instance_color");
+
 	// init GL states
 	glLineWidth( 1.0f );
 	glClearColor( 10/255.0f, 10/255.0f, 10/255.0f, 1.0f );	// set clear color
@@ -303,64 +575,123 @@ bool user_init()
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-	unit_cube_vertices = std::move(create_cube_verticese(NUM_TESS, main_cube, steps));
-	update_vertex_buffer(unit_cube_vertices, NUM_TESS, steps, main_cube);
+	unit_cube_vertices = std::move(create_cube_vertices());
+	update_vertex_buffer(unit_cube_vertices);
+
+	// create the ring for per-frame data; instances and glyph quads are written into it
+	frame_ring.create( 256*1024 );
+
+	// create the vertex array of the cube geometry with the instance attributes
+	vertex_array = cg_create_vertex_array( vertex_buffer, index_buffer );
+	glBindVertexArray( vertex_array );
+	bind_instance_attributes();
+	glBindVertexArray( 0 );
 
 	// setup freetype
 	text_init();
+	score_number = hud_number_create(900, 520, 0.5f, vec4(107 / 255.0f, 236 / 225.0f, 219 / 225.0f, 1.0f));
 
+	// query rings of the profiler's GPU passes
+	profiler.scene_timer.create();
+	profiler.text_timer.create();
+	latency.create();
+
+	attrib_pointer_calls = cg_attrib_pointer_count();
+	gpu_stats_t::instance().print( "user_init" );
 	return true;
 }
 
 void user_finalize()
 {
+	vertex_buffer.release();
+	index_buffer.release();
+	frame_ring.release();
+	if(vertex_array)	glDeleteVertexArrays( 1, &vertex_array );	vertex_array = 0;
+	text_finalize();
+	profiler.scene_timer.release();
+	profiler.text_timer.release();
+	glprof_uninstall();
+
+	// every GPU object should have been released with its owner
+	const gpu_stats_t& stats = gpu_stats_t::instance();
+	if(stats.buffers||stats.textures) stats.print( "leaked" );
+	printf( "vertex attribute specifications: %u at init, %u during %d frames\n", attrib_pointer_calls, cg_attrib_pointer_count()-attrib_pointer_calls, frame );
 }
 
-int main( int argc, char* argv[] )
+void render_loop( pace_mode_t pace_mode, double pace_rate )
 {
-	while (1) {
-		std::ifstream in("map.txt");
-		std::string s;
-
-		while (!map.empty()) map.pop();
-		for (map_size = 0; map_size < 1000 && !in.eof(); map_size++) {
-			in >> s;
-			map.push(stoi(s));
-		}
-
-		steps = std::move(create_steps());
-
-		// initialization
-		if (!glfwInit()) { printf("[error] failed in glfwInit()\n"); return 1; }
-
-		// create window and initialize OpenGL extensions
-		if (!(window = cg_create_window(window_name, window_size.x, window_size.y))) { glfwTerminate(); return 1; }
-		if (!cg_init_extensions(window)) { glfwTerminate(); return 1; }	// init OpenGL extensions
-
-		// initializations and validations of GLSL program
-		if (!(program = cg_create_program(vert_shader_path, frag_shader_path))) { glfwTerminate(); return 1; }	// create and compile shaders/program
-		if (!user_init()) { printf("Failed to user_init()\n"); glfwTerminate(); return 1; }					// user initialization
+	// frames are paced, simulated and drawn on this thread, with the context current
+	glfwMakeContextCurrent(window);
+	pacer.start(pace_mode, pace_rate);
+	while (!glfwWindowShouldClose(window))
+	{
+		pacer.wait();		// sleeps until the next frame instead of spinning
+		const double t0 = now_seconds();
+		simulate();			// fixed-rate game ticks with the queued input
+		const double t1 = now_seconds();
+		update();			// per-frame update
+		profiler.cpu[STAGE_SIM].add((t1 - t0) * 1000.0);
+		profiler.cpu[STAGE_UPDATE].add((now_seconds() - t1) * 1000.0);
+		render();			// per-frame render
+	}
+	pacer.stop();
+	glfwMakeContextCurrent(nullptr);
+}
 
-		double now = glfwGetTime();
-		while (!glfwWindowShouldClose(window))
-		{
-			// register event callbacks
-			glfwSetWindowSizeCallback(window, reshape);	// callback for window resizing events
-			glfwSetKeyCallback(window, keyboard);			// callback for keyboard events
-			glfwSetMouseButtonCallback(window, mouse);	// callback for mouse click inputs
-			glfwSetCursorPosCallback(window, motion);		// callback for mouse movements
-
-			if ((glfwGetTime() >= now + 0.005)) {
-				now = glfwGetTime();
-				glfwPollEvents();	// polling and processing of events
-				update();			// per-frame update
-				render();			// per-frame render
-			}
-		}
+int main( int argc, char* argv[] )
+{
+	// frame pacing options; the game ticks at tick_rate regardless of the frame rate
+	pace_mode_t pace_mode = PACE_HYBRID;
+	double pace_rate = 200.0;
+	for (int k = 1; k < argc; k++)
+	{
+		if (strcmp(argv[k], "--vsync") == 0) pace_mode = PACE_VSYNC;
+		else if (strcmp(argv[k], "--uncapped") == 0) pace_mode = PACE_UNCAPPED;
+		else if (strcmp(argv[k], "--rate") == 0 && k + 1 < argc) pace_rate = atof(argv[++k]);
+		else { printf("usage: %s [--vsync|--uncapped] [--rate N]\n", argv[0]); return 1; }
+	}
 
-		// normal termination
-		user_finalize();
-		cg_destroy_window(window);
+	// load the assets on worker threads while the window and the context come up; GL uploads stay on this thread
+	launch_time = std::chrono::steady_clock::now();
+	std::future<std::queue<int>> chart = std::async(std::launch::async, parse_chart, chart_path);
+	std::future<bool> font = std::async(std::launch::async, text_prepare);
+
+	// initialization
+	if (!glfwInit()) { printf("[error] failed in glfwInit()\n"); return 1; }
+
+	// create window and initialize OpenGL extensions
+	if (!(window = cg_create_window(window_name, window_size.x, window_size.y))) { glfwTerminate(); return 1; }
+	if (!cg_init_extensions(window)) { glfwTerminate(); return 1; }	// init OpenGL extensions
+
+	// initializations and validations of GLSL program
+	if (!(program = cg_create_program(vert_shader_path, frag_shader_path))) { glfwTerminate(); return 1; }	// create and compile shaders/program
+	font.wait();	// text_init() in user_init() uploads the prepared atlas
+	if (!user_init()) { printf("Failed to user_init()\n"); glfwTerminate(); return 1; }					// user initialization
+	game_reset(chart.get());
+
+	// register event callbacks
+	glfwSetWindowSizeCallback(window, reshape);	// callback for window resizing events
+	glfwSetKeyCallback(window, keyboard);			// callback for keyboard events
+	glfwSetMouseButtonCallback(window, mouse);	// callback for mouse click inputs
+	glfwSetCursorPosCallback(window, motion);		// callback for mouse movements
+
+	// the render thread owns the context from here; this thread keeps sampling the input
+	glfwMakeContextCurrent(nullptr);
+	std::thread renderer(render_loop, pace_mode, pace_rate);
+	while (!glfwWindowShouldClose(window))
+	{
+		glfwWaitEventsTimeout(input_interval);	// returns on window events at once, or after an interval for the joysticks
+		poll_joysticks();
 	}
+	renderer.join();
+	glfwMakeContextCurrent(window);
+	pacer.print();
+	latency.collect(true);
+	latency.print();
+	latency.release();
+
+	// normal termination
+	user_finalize();
+	cg_destroy_window(window);
 	return 0;
 }
@@ -1,197 +1,752 @@
 #include "cgmath.h"			// slee's simple math library
 #include "cgut.h"			// slee's OpenGL utility
+#include <algorithm>
+#include <unordered_map>
 
 #define STB_TRUETYPE_IMPLEMENTATION
 #include "stb_truetype.h"
 
 //*******************************************************************
 // stb_truetype object
-stbtt_fontinfo font_info;			// font information
+stbtt_fontinfo	font_info;			// font information
+mapped_file_t	font_file;			// view of the font file; font_info points into it
 
-GLuint		VAO, VBO;				// vertex array for text objects
-GLuint		program_text;			// GPU program for text render
+GLuint		VAO;					// vertex array for text objects; its vertices live in the frame ring
+program_t	program_text;			// GPU program for text render
+uniform_t<int>	text_sampler;		// sampler of the glyph atlas in program_text
+static const int	atlas_unit = 0;	// texture unit of the glyph atlas
 
-static const char*	font_path = "C:/Windows/Fonts/consola.ttf";
+// font files searched in order; relative paths are resolved by cg_resolve_path()
+std::vector<const char*> font_search_paths = {
+	"C:/Windows/Fonts/consola.ttf",
+	"/usr/share/fonts/truetype/dejavu/DejaVuSansMono.ttf",
+	"/usr/share/fonts/TTF/DejaVuSansMono.ttf",
+	"/usr/share/fonts/dejavu/DejaVuSansMono.ttf",
+	"/usr/share/fonts/truetype/liberation/LiberationMono-Regular.ttf",
+	"../bin/fonts/DejaVuSansMono.ttf",		// bundled fallback
+};
 static const char*	vert_text_path = "../bin/shaders/text.vert";		// text vertex shaders
 static const char*	frag_text_path = "../bin/shaders/text.frag";		// text fragment shaders
+static const char*	frag_text_sdf_path = "../bin/shaders/text_sdf.frag";	// text fragment shaders for signed distance fields
+
+static const float	font_pixel_height = 48.0f;		// rasterization size of glyphs
+static const int	first_char = 32, char_count = 95;	// printable ASCII characters in the atlas
+static const float	sdf_pixel_height = 32.0f;		// SDF glyphs are rasterized smaller and reconstructed at any scale
+static const int	sdf_padding = 4;				// distance range in texels around each SDF glyph
 
 struct stbtt_char_t
 {
-	GLuint	textureID;				// ID handle of the glyph texture
-	ivec2	size;					// Size of glyph
-	ivec2	bearing;				// Offset from baseline to left/top of glyph
-	GLuint	advance;				// Horizontal offset to advance to next glyph
+	vec4	uv;						// Texture coordinates of glyph in the atlas (left, top, right, bottom)
+	vec2	size;					// Size of glyph in 48 px units
+	vec2	bearing;				// Offset from baseline to left/top of glyph
+	GLfloat	advance;				// Horizontal offset to advance to next glyph
+	GLfloat	layer;					// Atlas layer: 0 for the baked glyphs, and a page for the others
+};
+stbtt_char_t	stbtt_char_table[128];	// glyphs indexed by codepoint; control characters stay empty
+gl_texture_t	font_atlas;				// texture array: the baked glyphs in layer 0, and pages of glyphs rasterized on demand
+
+struct text_vertex_t
+{
+	vec4	vertex;					// x, y in pixels, texcoord x, texcoord y
+	vec4	color;					// RGBA color in [0,1]
+	GLfloat	layer;					// atlas layer
+};
+
+struct glyph_quad_t
+{
+	vec4	uv;						// texture coordinates of the glyph in the atlas
+	vec4	rect;					// x, y, width, height in pixels
+	vec4	color;					// RGBA color in [0,1]
+	GLfloat	layer;					// atlas layer
+};
+std::vector<glyph_quad_t> glyph_batch;	// glyphs of all the strings of a frame, flushed by flush_text()
+
+//*******************************************************************
+// retained layouts: strings drawn again with the same scale, position and color reuse their vertices
+struct text_range_t
+{
+	GLint	first;					// first vertex in the layout cache buffer
+	GLsizei	count;					// number of vertices
+};
+
+struct text_layout_t
+{
+	text_range_t	range;
+	uint			last_frame;		// the last frame in which the layout was drawn
+	uint			pages;			// bit mask of the atlas pages used by the layout
+
+	// the parameters of the layout, compared on a hit since text_layout_key() may collide
+	std::string		text;
+	GLint			x, y;
+	GLfloat			scale;
+	vec4			color;
+	bool matches( const char* t, GLint _x, GLint _y, GLfloat s, const vec4& c ) const { return x==_x && y==_y && scale==s && color.x==c.x && color.y==c.y && color.z==c.z && color.w==c.w && text==t; }
+};
+
+static const size_t	text_cache_glyphs = 4096;		// capacity of the layout cache buffer
+static const int	hud_number_digits = 11;			// enough for any int, including the sign
+static const int	max_hud_numbers = 8;			// HUD number slots after the layouts in the cache buffer
+GLuint								cache_VAO;			// vertex array for the layout cache buffer
+gl_buffer_t							text_cache_buffer;	// vertices of the retained layouts
+std::unordered_map<uint64_t, text_layout_t>	text_layouts;	// layouts by text_layout_key()
+std::vector<text_range_t>			text_draws;			// cached ranges to draw in this frame
+std::vector<GLint>					text_draw_firsts;	// merged ranges of text_draws for glMultiDrawArrays()
+std::vector<GLsizei>				text_draw_counts;
+std::vector<text_vertex_t>			text_scratch;		// vertices of a new layout before upload
+std::vector<text_range_t>			text_cache_free;	// free vertex ranges of the cache buffer, sorted and coalesced
+uint								text_frame = 0;
+uint								text_layouts_built = 0;	// strings laid out on a cache miss; only those may allocate
+
+// first fit from the free ranges; fails when no free range is long enough
+bool text_cache_alloc( GLsizei count, text_range_t& range )
+{
+	for (size_t k = 0; k < text_cache_free.size(); k++)
+	{
+		text_range_t& f = text_cache_free[k];
+		if (f.count < count) continue;
+		range = { f.first, count };
+		f.first += count; f.count -= count;
+		if (!f.count) text_cache_free.erase(text_cache_free.begin() + k);
+		return true;
+	}
+	return false;
+}
+
+// return the range of an evicted layout, merging it with its free neighbors; the reserved capacity covers the worst fragmentation
+void text_cache_release( text_range_t range )
+{
+	auto it = std::lower_bound(text_cache_free.begin(), text_cache_free.end(), range, [](const text_range_t& a, const text_range_t& b) { return a.first < b.first; });
+	it = text_cache_free.insert(it, range);
+	if (it + 1 != text_cache_free.end() && it->first + it->count == (it + 1)->first) { it->count += (it + 1)->count; text_cache_free.erase(it + 1); }
+	if (it != text_cache_free.begin() && (it - 1)->first + (it - 1)->count == it->first) { (it - 1)->count += it->count; text_cache_free.erase(it); }
+}
+
+void text_cache_reset()
+{
+	text_cache_free.clear();
+	text_cache_free.push_back({ 0, GLsizei(6 * text_cache_glyphs) });
+}
+
+// HUD number widget: digits are formatted on the stack and patched in place in its slot of the cache buffer
+struct hud_number_t
+{
+	GLint	x, y;
+	GLfloat	scale;
+	vec4	color;
+	char	text[hud_number_digits];	// characters now in the slot
+	GLfloat	pen[hud_number_digits];		// x of each character now in the slot
+	int		length;
+};
+hud_number_t	hud_numbers[max_hud_numbers];
+int				hud_number_count = 0;
+
+// Vertices of a unit quad: x, y, texcoord x, texcoord y
+static const vec4 glyph_quad_vertices[6] = {
+		{ 0.0f, 1.0f, 0.0f, 0.0f },
+		{ 0.0f, 0.0f, 0.0f, 1.0f },
+		{ 1.0f, 0.0f, 1.0f, 1.0f },
+
+		{ 0.0f, 1.0f, 0.0f, 0.0f },
+		{ 1.0f, 0.0f, 1.0f, 1.0f },
+		{ 1.0f, 1.0f, 1.0f, 0.0f },
+};
+
+inline text_vertex_t* write_glyph_vertices( const glyph_quad_t& g, text_vertex_t* v )
+{
+	for (const vec4& q : glyph_quad_vertices) *v++ = { vec4(g.rect.x + q.x * g.rect.z, g.rect.y + q.y * g.rect.w, g.uv.x + q.z * (g.uv.z - g.uv.x), g.uv.y + q.w * (g.uv.w - g.uv.y)), g.color, g.layer };
+	return v;
+}
+
+inline uint64_t text_layout_key( const char* text, GLint x, GLint y, GLfloat scale, const vec4& color )
+{
+	uint64_t h = cg_hash( text, strlen(text) );
+	h = cg_hash( &x, sizeof(x), h );
+	h = cg_hash( &y, sizeof(y), h );
+	h = cg_hash( &scale, sizeof(scale), h );
+	return cg_hash( &color, sizeof(color), h );
+}
+
+//*******************************************************************
+// glyphs beyond ASCII: rasterized on first use into atlas pages, and evicted by the page, least recently used first
+static const int	atlas_page_size = 512;			// minimum width and height of the atlas layers
+static const int	atlas_pages = 4;				// layers 1..atlas_pages are pages of glyphs rasterized on demand
+
+struct atlas_page_t
+{
+	int		pen_x, pen_y, row_height;	// shelf packing cursor
+	uint	last_used;					// the last frame in which a glyph of the page was drawn
 };
-std::map<GLchar, stbtt_char_t> stbtt_char_list;
+atlas_page_t	atlas_page_list[atlas_pages + 1];	// indexed by layer; layer 0 holds the baked glyphs and is never evicted
+ivec2			atlas_layer_size;
+std::unordered_map<uint, stbtt_char_t>	dynamic_glyphs;	// glyphs by codepoint
+std::vector<unsigned char>				glyph_scratch;	// a glyph with its blank border before upload
 
-void create_font_textures()
+// fonts searched for glyphs that the primary font lacks, e.g., Hangul
+std::vector<const char*> fallback_font_paths = {
+	"C:/Windows/Fonts/malgun.ttf",
+	"C:/Windows/Fonts/gulim.ttc",
+	"/usr/share/fonts/truetype/nanum/NanumGothic.ttf",
+	"/usr/share/fonts/opentype/noto/NotoSansCJK-Regular.ttc",
+	"/usr/share/fonts/noto-cjk/NotoSansCJK-Regular.ttc",
+	"/usr/share/fonts/truetype/unfonts-core/UnDotum.ttf",
+};
+
+struct font_source_t
 {
+	mapped_file_t	file;
+	stbtt_fontinfo	info;
+};
+static const int	max_fallback_fonts = 4;
+font_source_t		fallback_fonts[max_fallback_fonts];
+int					fallback_font_count = -1;	// -1 until the fallback fonts are opened on first use
+
+void open_fallback_fonts()
+{
+	if (fallback_font_count >= 0) return;
+	fallback_font_count = 0;
+	for (const char* path : fallback_font_paths)
+	{
+		if (fallback_font_count == max_fallback_fonts) break;
+		font_source_t& f = fallback_fonts[fallback_font_count];
+		if (!f.file.open( cg_resolve_path( path ).c_str() )) continue;
+		const int offset = stbtt_GetFontOffsetForIndex( f.file.ptr, 0 );
+		if (offset >= 0 && stbtt_InitFont( &f.info, f.file.ptr, offset )) { fallback_font_count++; continue; }
+		f.file.close();
+	}
+}
+
+// decodes the UTF-8 sequence at p and advances p past it; malformed sequences decode to U+FFFD
+inline uint utf8_decode( const char*& p )
+{
+	const unsigned char* s = (const unsigned char*) p;
+	uint c = s[0];
+	const int n = c < 0x80 ? 0 : (c >> 5) == 0x6 ? 1 : (c >> 4) == 0xE ? 2 : (c >> 3) == 0x1E ? 3 : -1;
+	if (n <= 0) { p++; return n ? 0xFFFD : c; }
+	c &= 0x3F >> n;
+	for (int k = 1; k <= n; k++)
+	{
+		if ((s[k] & 0xC0) != 0x80) { p += k; return 0xFFFD; }	// also stops at the terminator
+		c = (c << 6) | (s[k] & 0x3F);
+	}
+	p += n + 1;
+	return c;
+}
+
+inline bool shelf_alloc( atlas_page_t& page, int width, int height, ivec2& pos )
+{
+	if (page.pen_x + width > atlas_layer_size.x) { page.pen_x = 0; page.pen_y += page.row_height; page.row_height = 0; }
+	if (page.pen_y + height > atlas_layer_size.y) return false;
+	pos = ivec2( page.pen_x, page.pen_y );
+	page.pen_x += width;
+	page.row_height = max( page.row_height, height );
+	return true;
+}
+
+void evict_page( int layer )
+{
+	atlas_page_list[layer] = atlas_page_t();
+	for (auto it = dynamic_glyphs.begin(); it != dynamic_glyphs.end(); )
+		it = int(it->second.layer) == layer ? dynamic_glyphs.erase(it) : std::next(it);
+	for (auto it = text_layouts.begin(); it != text_layouts.end(); )
+	{
+		if (!((it->second.pages >> layer) & 1u)) { ++it; continue; }
+		text_cache_release(it->second.range);
+		it = text_layouts.erase(it);
+	}
+}
+
+// places a block on a page; when all pages are full, the least recently used page not drawn in this frame is evicted
+int place_on_page( int width, int height, ivec2& pos )
+{
+	if (width > atlas_layer_size.x || height > atlas_layer_size.y) return 0;
+	for (int layer = 1; layer <= atlas_pages; layer++) if (shelf_alloc( atlas_page_list[layer], width, height, pos )) return layer;
+
+	int lru = 0;
+	for (int layer = 1; layer <= atlas_pages; layer++)
+	{
+		const uint last_used = atlas_page_list[layer].last_used;
+		if (last_used != text_frame && (!lru || last_used < atlas_page_list[lru].last_used)) lru = layer;
+	}
+	if (!lru) return 0;
+	evict_page( lru );
+	return shelf_alloc( atlas_page_list[lru], width, height, pos ) ? lru : 0;
+}
+
+// finds a glyph beyond ASCII, rasterizing it on first use; nullptr when every page is in use by this frame
+const stbtt_char_t* find_glyph( uint codepoint )
+{
+	auto it = dynamic_glyphs.find( codepoint );
+	if (it != dynamic_glyphs.end()) return &it->second;
+
+	// Take the glyph from the primary font, then from the fallback fonts, or the missing glyph of the primary font
+	const stbtt_fontinfo* info = &font_info;
+	int glyph = stbtt_FindGlyphIndex( &font_info, int(codepoint) );
+	if (!glyph)
+	{
+		open_fallback_fonts();
+		for (int k = 0; k < fallback_font_count; k++)
+			if ((glyph = stbtt_FindGlyphIndex( &fallback_fonts[k].info, int(codepoint) )) != 0) { info = &fallback_fonts[k].info; break; }
+	}
+
+	extern bool b_sdf_text;
+	const float pixel_height = b_sdf_text ? sdf_pixel_height : font_pixel_height;
+	const float font_scale = stbtt_ScaleForPixelHeight( info, pixel_height );
+	const float metric_scale = font_pixel_height / pixel_height;	// keep the layout in the units of the bitmap font
+	int width = 0, height = 0, xoff = 0, yoff = 0;
+	unsigned char* bitmap = b_sdf_text ?
+		stbtt_GetGlyphSDF( info, font_scale, glyph, sdf_padding, 128, 128.0f / sdf_padding, &width, &height, &xoff, &yoff ) :
+		stbtt_GetGlyphBitmap( info, font_scale, font_scale, glyph, &width, &height, &xoff, &yoff );
+
+	int advance, left_side_bearing;
+	stbtt_GetGlyphHMetrics( info, glyph, &advance, &left_side_bearing );
+
+	stbtt_char_t ch = stbtt_char_t();
+	ch.advance = advance * font_scale * metric_scale;
+	if (bitmap && width > 0 && height > 0)
+	{
+		// Upload the glyph with a blank border, so that filtering never reaches its neighbors
+		ivec2 pos;
+		const int layer = place_on_page( width + 2, height + 2, pos );
+		if (!layer) { STBTT_free( bitmap, nullptr ); return nullptr; }
+		glyph_scratch.assign( size_t(width + 2) * (height + 2), 0 );
+		for (int y = 0; y < height; y++) memcpy( &glyph_scratch[size_t(y + 1) * (width + 2) + 1], bitmap + y * width, width );
+		glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+		font_atlas.sub_image2d_array( pos.x, pos.y, layer, width + 2, height + 2, GL_RED, GL_UNSIGNED_BYTE, &glyph_scratch[0] );
+
+		ch.uv = vec4( (pos.x + 1) / float(atlas_layer_size.x), (pos.y + 1) / float(atlas_layer_size.y), (pos.x + 1 + width) / float(atlas_layer_size.x), (pos.y + 1 + height) / float(atlas_layer_size.y) );
+		ch.size = vec2( float(width), float(height) ) * metric_scale;
+		ch.bearing = vec2( float(xoff), float(-yoff) ) * metric_scale;	// flip y axis
+		ch.layer = float(layer);
+		atlas_page_list[layer].last_used = text_frame;
+	}
+	if (bitmap) STBTT_free( bitmap, nullptr );
+	return &(dynamic_glyphs[codepoint] = ch);
+}
+
+void upload_font_atlas( ivec2 atlas_size, const unsigned char* pixels )
+{
+	// Generate the atlas texture; layer 0 holds the baked glyphs, and the others are pages for glyphs rasterized on demand
+	atlas_layer_size = ivec2( max( atlas_size.x, atlas_page_size ), max( atlas_size.y, atlas_page_size ) );
 	glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
-	for (GLubyte c = 0; c < 128; c++)
-	{	
-		// Font size (pixel) to scale
-		float font_scale = stbtt_ScaleForPixelHeight( &font_info, 48 );
-
-		// Get bitmap and bitmap info of character
-		int width, height, offset_x, offset_y;
-		unsigned char* bitmap = stbtt_GetCodepointBitmap( 
-			&font_info, 									// Font information
-			0.0f, 											// Scale in x axis
-			font_scale, 									// Scale in y axis
-			c, 												// Character
-			&width, 										// Width of bitmap
-			&height, 										// Height of bitmap
-			&offset_x, 										// Left bearing of bitmap
-			&offset_y 										// Top bearing of bitmap (negative value)
-		);
-
-		// Generate texture
-		GLuint texture_text;
-		glGenTextures( 1, &texture_text );
-		glBindTexture( GL_TEXTURE_2D, texture_text );
-		glTexImage2D(
-			GL_TEXTURE_2D,
-			0,
-			GL_RED,
-			width,
-			height,
-			0,
-			GL_RED,
-			GL_UNSIGNED_BYTE,
-			bitmap
-		);
-
-		// Release bitmap
-		stbtt_FreeBitmap( bitmap, font_info.userdata );
-
-		// Set texture options
-		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
-		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-
-		// Get advance in x axis
-		int advance_width = 0;
-		stbtt_GetCodepointHMetrics( &font_info, c, &advance_width, nullptr );
-
-		// Now store character for later use
-		stbtt_char_t character =
-		{
-			texture_text,
-			ivec2( width, height ),
-			ivec2( offset_x, -offset_y ),			// flip y axis
-			GLuint( advance_width * font_scale )
-		};
-		stbtt_char_list.insert( std::pair<GLchar, stbtt_char_t>( c, character ) );
+	font_atlas.create();
+	font_atlas.image2d_array( GL_R8, atlas_layer_size.x, atlas_layer_size.y, 1 + atlas_pages, GL_RED, GL_UNSIGNED_BYTE, nullptr );
+	if (atlas_size.x == atlas_layer_size.x && atlas_size.y == atlas_layer_size.y) font_atlas.sub_image2d_array( 0, 0, 0, atlas_size.x, atlas_size.y, GL_RED, GL_UNSIGNED_BYTE, pixels );
+	else
+	{
+		// pad the baked glyphs with blank texels, which filtering may reach at the edges
+		std::vector<unsigned char> layer( size_t(atlas_layer_size.x) * atlas_layer_size.y, 0 );
+		for (int y = 0; y < atlas_size.y; y++) memcpy( &layer[size_t(y) * atlas_layer_size.x], pixels + size_t(y) * atlas_size.x, atlas_size.x );
+		font_atlas.sub_image2d_array( 0, 0, 0, atlas_layer_size.x, atlas_layer_size.y, GL_RED, GL_UNSIGNED_BYTE, &layer[0] );
 	}
 
-	printf( "Font textures created well using stb_truetype\n\n" );
+	// Set texture options
+	glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+
+	// The baked texture coordinates are relative to the baked atlas
+	const vec2 uv_scale = vec2( atlas_size.x / float(atlas_layer_size.x), atlas_size.y / float(atlas_layer_size.y) );
+	for (stbtt_char_t& ch : stbtt_char_table) ch.uv = vec4( ch.uv.x * uv_scale.x, ch.uv.y * uv_scale.y, ch.uv.z * uv_scale.x, ch.uv.w * uv_scale.y );
 }
 
-void text_init()
+bool create_font_atlas( const unsigned char* font_buffer, ivec2& atlas_size, std::vector<unsigned char>& pixels )
+{
+	std::vector<stbtt_packedchar> packed( char_count );
+	stbtt_pack_range range = {};
+	range.font_size = font_pixel_height;				// positive size means pixel height
+	range.first_unicode_codepoint_in_range = first_char;
+	range.num_chars = char_count;
+	range.chardata_for_range = &packed[0];
+
+	// Pack the glyphs, growing the atlas until all of them fit
+	atlas_size = ivec2( 256, 256 );
+	for (;;)
+	{
+		pixels.assign( size_t(atlas_size.x) * atlas_size.y, 0 );
+		stbtt_pack_context pack_context;
+		if (!stbtt_PackBegin( &pack_context, &pixels[0], atlas_size.x, atlas_size.y, 0, 1, nullptr )) { printf( "Failed to begin glyph packing.\n" ); return false; }
+		int packed_all = stbtt_PackFontRanges( &pack_context, font_buffer, 0, &range, 1 );
+		stbtt_PackEnd( &pack_context );
+		if (packed_all) break;
+		if (atlas_size.x > 4096) { printf( "Glyphs do not fit into a %dx%d atlas.\n", atlas_size.x, atlas_size.y ); return false; }
+		if (atlas_size.x <= atlas_size.y) atlas_size.x *= 2; else atlas_size.y *= 2;
+	}
+
+	// Now store characters for later use
+	for (stbtt_char_t& ch : stbtt_char_table) ch = stbtt_char_t();
+	for (int k = 0; k < char_count; k++)
+	{
+		const stbtt_packedchar& p = packed[k];
+		stbtt_char_t& ch = stbtt_char_table[first_char + k];
+		ch.uv = vec4( p.x0 / float(atlas_size.x), p.y0 / float(atlas_size.y), p.x1 / float(atlas_size.x), p.y1 / float(atlas_size.y) );
+		ch.size = vec2( float(p.x1 - p.x0), float(p.y1 - p.y0) );
+		ch.bearing = vec2( p.xoff, -p.yoff );	// flip y axis
+		ch.advance = p.xadvance;
+	}
+
+	printf( "Font atlas (%dx%d) created well using stb_truetype\n\n", atlas_size.x, atlas_size.y );
+	return true;
+}
+
+bool create_sdf_font_atlas( ivec2& atlas_size, std::vector<unsigned char>& pixels )
+{
+	const float font_scale = stbtt_ScaleForPixelHeight( &font_info, sdf_pixel_height );
+	const float metric_scale = font_pixel_height / sdf_pixel_height;	// keep the layout in the units of the bitmap font
+
+	// Generate the distance fields and place them on shelves of a fixed-width atlas
+	struct sdf_glyph_t { unsigned char* bitmap; int width, height, xoff, yoff; ivec2 pos; };
+	std::vector<sdf_glyph_t> sdf( char_count );
+	atlas_size = ivec2( 256, 1 );
+	int pen_x = 1, pen_y = 1, row_height = 0;
+	for (int k = 0; k < char_count; k++)
+	{
+		sdf_glyph_t& g = sdf[k]; g = sdf_glyph_t();
+		g.bitmap = stbtt_GetCodepointSDF( &font_info, font_scale, first_char + k, sdf_padding, 128, 128.0f / sdf_padding, &g.width, &g.height, &g.xoff, &g.yoff );
+		if (!g.bitmap) { g.width = g.height = 0; continue; }	// blank glyphs such as space
+		if (pen_x + g.width + 1 > atlas_size.x) { pen_x = 1; pen_y += row_height + 1; row_height = 0; }
+		g.pos = ivec2( pen_x, pen_y );
+		pen_x += g.width + 1;
+		row_height = max( row_height, g.height );
+	}
+	while (atlas_size.y < pen_y + row_height + 1) atlas_size.y *= 2;
+
+	// Copy the glyphs into the atlas and store them for later use
+	pixels.assign( size_t(atlas_size.x) * atlas_size.y, 0 );
+	for (stbtt_char_t& ch : stbtt_char_table) ch = stbtt_char_t();
+	for (int k = 0; k < char_count; k++)
+	{
+		const sdf_glyph_t& g = sdf[k];
+		for (int y = 0; y < g.height; y++) memcpy( &pixels[size_t(g.pos.y + y) * atlas_size.x + g.pos.x], g.bitmap + y * g.width, g.width );
+		if (g.bitmap) stbtt_FreeSDF( g.bitmap, nullptr );
+
+		int advance, left_side_bearing;
+		stbtt_GetCodepointHMetrics( &font_info, first_char + k, &advance, &left_side_bearing );
+
+		stbtt_char_t& ch = stbtt_char_table[first_char + k];
+		ch.uv = vec4( g.pos.x / float(atlas_size.x), g.pos.y / float(atlas_size.y), (g.pos.x + g.width) / float(atlas_size.x), (g.pos.y + g.height) / float(atlas_size.y) );
+		ch.size = vec2( float(g.width), float(g.height) ) * metric_scale;
+		ch.bearing = vec2( float(g.xoff), float(-g.yoff) ) * metric_scale;	// flip y axis
+		ch.advance = advance * font_scale * metric_scale;
+	}
+
+	printf( "SDF font atlas (%dx%d) created well using stb_truetype\n\n", atlas_size.x, atlas_size.y );
+	return true;
+}
+
+//*******************************************************************
+// baked glyph cache: the atlas and the glyph table of a font, reused while the hash matches
+struct glyph_cache_header_t
+{
+	char		magic[8];				// "CGGLYPH2"
+	uint64_t	hash;					// font file, glyph range and rasterization parameters
+	ivec2		atlas_size;
+};
+
+inline uint64_t glyph_cache_hash( bool sdf )
+{
+	const float params[] = { font_pixel_height, sdf_pixel_height, float(sdf_padding), float(first_char), float(char_count), sdf ? 1.0f : 0.0f };
+	return cg_hash( params, sizeof(params), cg_hash( font_file.ptr, font_file.size ) );
+}
+
+inline std::string glyph_cache_path( bool sdf )
 {
-	// Read and check font file
-	FILE* font_file = fopen( font_path, "rb" );
-	//if (!font_file) { printf( "Font file does not exists.\n" ); exit(-1); }
+	return std::string(cg_cache_dir()) + (sdf ? "glyphs_sdf.cache" : "glyphs.cache");
+}
+
+// atlas prepared by text_prepare() for the upload in text_init()
+struct prepared_atlas_t
+{
+	bool						ready = false;
+	ivec2						size;
+	std::vector<unsigned char>	pixels;		// glyphs rasterized in this run
+	mapped_file_t				cache;		// or the view of the glyph cache
+
+	const unsigned char* data() const { return cache ? cache.ptr + sizeof(glyph_cache_header_t) + sizeof(stbtt_char_table) : &pixels[0]; }
+	void clear(){ ready = false; cache.close(); std::vector<unsigned char>().swap( pixels ); }
+} prepared_atlas;
+
+bool load_glyph_cache( bool sdf, uint64_t hash )
+{
+	mapped_file_t& cache = prepared_atlas.cache;
+	if (!cache.open( glyph_cache_path( sdf ).c_str() ) || cache.size < sizeof(glyph_cache_header_t)) { cache.close(); return false; }
 
-	// Get size of file
-	fseek( font_file, 0, SEEK_END );
-	const unsigned int size = ftell( font_file );
-	fseek( font_file, 0, SEEK_SET );
+	const glyph_cache_header_t& header = *(const glyph_cache_header_t*) cache.ptr;
+	const size_t pixel_bytes = size_t(header.atlas_size.x) * header.atlas_size.y;
+	if (memcmp( header.magic, "CGGLYPH2", 8 ) != 0 || header.hash != hash || cache.size != sizeof(header) + sizeof(stbtt_char_table) + pixel_bytes) { cache.close(); return false; }
+
+	// The atlas is uploaded straight from the mapped view
+	memcpy( stbtt_char_table, cache.ptr + sizeof(header), sizeof(stbtt_char_table) );
+	prepared_atlas.size = header.atlas_size;
+	printf( "Font atlas (%dx%d) loaded from the glyph cache\n\n", header.atlas_size.x, header.atlas_size.y );
+	return true;
+}
+
+void save_glyph_cache( bool sdf, uint64_t hash, ivec2 atlas_size, const std::vector<unsigned char>& pixels )
+{
+	const std::string path = glyph_cache_path( sdf );
+	FILE* fp = fopen( path.c_str(), "wb" ); if (!fp) { printf( "Unable to write %s\n", path.c_str() ); return; }
+
+	glyph_cache_header_t header = { { 'C','G','G','L','Y','P','H','2' }, hash, atlas_size };
+	fwrite( &header, sizeof(header), 1, fp );
+	fwrite( stbtt_char_table, sizeof(stbtt_char_table), 1, fp );
+	fwrite( &pixels[0], 1, pixels.size(), fp );
+	fclose( fp );
+}
 
-	// Create font buffer to store
-	unsigned char* font_buffer = new unsigned char[size];
+// CPU side of text_init(), which may run on a worker thread: maps the font and prepares the glyph atlas without GL calls
+bool text_prepare()
+{
+	if (prepared_atlas.ready) return true;
 
-	// Read and close file
-	std::size_t read_size = fread( font_buffer, 1, size, font_file );
-	assert( read_size == size );
-	fclose( font_file );
+	// Map the first usable font file of the search list
+	const char* font_path = nullptr;
+	for (const char* path : font_search_paths)
+	{
+		if (!font_file.open( cg_resolve_path( path ).c_str() )) continue;
+		const int offset = stbtt_GetFontOffsetForIndex( font_file.ptr, 0 );
+		if (offset >= 0 && stbtt_InitFont( &font_info, font_file.ptr, offset )) { font_path = path; break; }
+		font_file.close();
+	}
+	if (!font_path) { printf( "[error] No usable font file found; text is disabled.\n" ); return false; }
+	printf( "Font: %s\n", font_path );
 
-	// Initialize stb truetype
-	int result = stbtt_InitFont( &font_info, font_buffer, 0 );
-	//if (!result) { printf( "Failed to initialize stb_truetype.\n" );  exit(-1); }
+	// Use the baked glyphs of this font, or rasterize and bake them
+	extern bool b_sdf_text;
+	const uint64_t hash = glyph_cache_hash( b_sdf_text );
+	if (!load_glyph_cache( b_sdf_text, hash ))
+	{
+		ivec2& atlas_size = prepared_atlas.size;
+		std::vector<unsigned char>& pixels = prepared_atlas.pixels;
+		if (!(b_sdf_text ? create_sdf_font_atlas( atlas_size, pixels ) : create_font_atlas( font_file.ptr, atlas_size, pixels ))) return false;
+		save_glyph_cache( b_sdf_text, hash, atlas_size, pixels );
+	}
+	prepared_atlas.ready = true;
+	return true;
+}
 
-	create_font_textures();
+void text_init()
+{
+	// Prepare the atlas here unless a worker has done it, and then upload it
+	if (!text_prepare()) return;
+	extern bool b_sdf_text;
+	upload_font_atlas( prepared_atlas.size, prepared_atlas.data() );
+	prepared_atlas.clear();
 
-	// Release buffer
-	delete[] font_buffer;
+	if (!(program_text = cg_create_program( vert_text_path, b_sdf_text ? frag_text_sdf_path : frag_text_path ))) { glfwTerminate(); return; }
+	text_sampler = program_text.uniform<int>( "text" );
+	glUseProgram(program_text);
+	text_sampler.set( atlas_unit );	// the program keeps the unit, so flush_text() only binds the atlas to it
+	glUseProgram(0);
+	glyph_batch.reserve(1024);
 
-	if (!(program_text = cg_create_program( vert_text_path, frag_text_path ))) { glfwTerminate(); return; }
+	// retained layouts live in their own buffer
+	text_cache_buffer.create( GL_ARRAY_BUFFER );
+	text_cache_buffer.data( nullptr, sizeof(text_vertex_t) * 6 * (text_cache_glyphs + size_t(max_hud_numbers) * hud_number_digits), GL_DYNAMIC_DRAW );
+	glGenVertexArrays(1, &cache_VAO);
+	glBindVertexArray(cache_VAO);
+	glBindBuffer(GL_ARRAY_BUFFER, text_cache_buffer);
+	cg_vertex_attrib_pointer(0, 4, sizeof(text_vertex_t), 0);
+	cg_vertex_attrib_pointer(1, 4, sizeof(text_vertex_t), sizeof(vec4));
+	cg_vertex_attrib_pointer(2, 1, sizeof(text_vertex_t), 2 * sizeof(vec4));
+	glBindVertexArray(0);
+	text_scratch.reserve(6 * 256);
+	text_draws.reserve(256);
+	text_draw_firsts.reserve(256);
+	text_draw_counts.reserve(256);
+	text_layouts.reserve(64);
+	text_cache_free.reserve(text_cache_glyphs / 2 + 1);	// free ranges alternate with layouts of at least one glyph
+	text_cache_reset();
 
+	// other glyph vertices are written per frame into the frame ring
+	extern gl_ring_buffer_t frame_ring;
 	glGenVertexArrays(1, &VAO);
-	glGenBuffers(1, &VBO);
 	glBindVertexArray(VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-
-	// Vertices below contain x, y, texcoord x, texcoord y
-	GLfloat vertices[6][4] = {
-			{ 0, 1, 0.0, 0.0 },
-			{ 0, 0, 0.0, 1.0 },
-			{ 1, 0, 1.0, 1.0 },
-
-			{ 0, 1, 0.0, 0.0 },
-			{ 1, 0, 1.0, 1.0 },
-			{ 1, 1, 1.0, 0.0 },
-	};
-	
-	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 6 * 4, vertices, GL_STATIC_DRAW);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), 0);
+	glBindBuffer(GL_ARRAY_BUFFER, frame_ring.buffer);
+	cg_vertex_attrib_pointer(0, 4, sizeof(text_vertex_t), 0);
+	cg_vertex_attrib_pointer(1, 4, sizeof(text_vertex_t), sizeof(vec4));
+	cg_vertex_attrib_pointer(2, 1, sizeof(text_vertex_t), 2 * sizeof(vec4));
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindVertexArray(0);
 }
 
-void render_text( std::string text, GLint _x, GLint _y, GLfloat scale, vec4 color )
+void text_finalize()
 {
-	// Activate corresponding render state	
-	extern ivec2 window_size;
+	// release glyphs so that the next text_init() rebuilds them in a new context
+	font_atlas.release();
+	font_file.close();
+	dynamic_glyphs.clear();
+	for (atlas_page_t& page : atlas_page_list) page = atlas_page_t();
+	for (font_source_t& f : fallback_fonts) f.file.close();
+	fallback_font_count = -1;
+	glyph_batch.clear();
+	text_layouts.clear(); text_draws.clear();
+	text_cache_free.clear();
+	hud_number_count = 0;
+	text_cache_buffer.release();
+	if(cache_VAO) glDeleteVertexArrays(1, &cache_VAO); cache_VAO = 0;
+	if(VAO) glDeleteVertexArrays(1, &VAO); VAO = 0;
+}
+
+void render_text( const char* text, GLint _x, GLint _y, GLfloat scale, vec4 color )
+{
+	if (!VAO) return;	// no font
+
+	// Reuse the layout of the string if it was drawn the same way before
+	const uint64_t key = text_layout_key( text, _x, _y, scale, color );
+	auto it = text_layouts.find( key );
+	const bool collision = it != text_layouts.end() && !it->second.matches( text, _x, _y, scale, color );
+	if (it != text_layouts.end() && !collision)
+	{
+		text_layout_t& layout = it->second;
+		layout.last_frame = text_frame;
+		for (int layer = 1; layer <= atlas_pages; layer++) if ((layout.pages >> layer) & 1u) atlas_page_list[layer].last_used = text_frame;
+		text_draws.push_back( layout.range );
+		return;
+	}
+	text_layouts_built++;
+
+	const size_t begin = glyph_batch.size();
 	GLfloat x = GLfloat(_x);
 	GLfloat y = GLfloat(_y);
-	glUseProgram(program_text);
-	glUniform4f(glGetUniformLocation(program_text, "textColor"), color.r, color.g, color.b, color.a);
-	glActiveTexture(GL_TEXTURE0);
-	glBindVertexArray(VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	mat4 text_offset = mat4( 1/(window_size.x/2.0f), 0.0f, 0.0f,-1.0f,		// view space conversion
-						 0.0f, 1/(window_size.y/2.0f), 0.0f, 1.0f,
-						 0.0f, 0.0f, 1.0f, 0.0f,
-						 0.0f, 0.0f, 0.0f, 1.0f
-						);
-
-	// Iterate through all characters
-	std::string::const_iterator c;
-	for (c = text.begin(); c != text.end(); c++)
-	{
-		stbtt_char_t ch = stbtt_char_list[*c];
-
-		mat4 text_size		= mat4(	scale * float(ch.size.x),0.0f,0.0f,0.0f,
-									0.0f,scale * float(ch.size.y),0.0f,0.0f,
-									0.0f,0.0f,1.0f,0.0f,
-									0.0f,0.0f,0.0f,1.0f
-									);
-
-		mat4 text_translate = mat4( 1.0f,0.0f,0.0f,	x  + scale * float(ch.bearing.x),
-									0.0f,1.0f,0.0f,	-y + scale * float(-(ch.size.y - ch.bearing.y)),
-									0.0f,0.0f,1.0f,	0.0f,
-									0.0f,0.0f,0.0f,	1.0f
-									);
-
-		mat4 text_matrix = mat4();
-		
-		text_matrix = text_translate * text_size * text_matrix;
-		//text_matrix = text_translate * text_matrix;
-		text_matrix = text_offset * text_matrix;
-		glUniformMatrix4fv(glGetUniformLocation(program_text, "text_matrix"), 1, GL_TRUE, text_matrix);
-
-		//// Render glyph texture over quad
- 		glBindTexture(GL_TEXTURE_2D, ch.textureID);
-		
-		// Render quad
-		glDrawArrays(GL_TRIANGLES, 0, 6);
+
+	// Iterate through all UTF-8 characters; quads stay in pixels, and text.vert maps them by the frame viewport
+	uint pages = 0;
+	bool complete = true;	// false if a glyph could not be rasterized because every atlas page is in use
+	for (const char* c = text; *c; )
+	{
+		const uint codepoint = utf8_decode( c );
+		const stbtt_char_t* glyph = codepoint < 128 ? &stbtt_char_table[codepoint] : find_glyph( codepoint );
+		if (!glyph) { complete = false; continue; }
+		const stbtt_char_t& ch = *glyph;
+		const int layer = int(ch.layer);
+		if (layer) { atlas_page_list[layer].last_used = text_frame; pages |= 1u << layer; }
+
+		// Queue the glyph; it is drawn with all the others by flush_text()
+		glyph_batch.push_back({ ch.uv,
+			vec4(x + scale * ch.bearing.x, -y - scale * (ch.size.y - ch.bearing.y), scale * ch.size.x, scale * ch.size.y),
+			color, ch.layer });
 
 		// Now advance cursors for next glyph
 		x += ch.advance * scale;
 	}
+
+	// Retain the new layout in the cache buffer; if no free range fits, a glyph is missing and should be
+	// retried in the next frame, or another string holds the key, the glyphs go through the frame ring
+	const size_t count = glyph_batch.size() - begin;
+	if (count == 0 || !complete || collision) return;
+	text_range_t range;
+	if (!text_cache_alloc(GLsizei(6 * count), range)) return;
+
+	text_scratch.resize(6 * count);
+	text_vertex_t* v = &text_scratch[0];
+	for (size_t k = begin; k < glyph_batch.size(); k++) v = write_glyph_vertices(glyph_batch[k], v);
+	text_cache_buffer.sub_data(sizeof(text_vertex_t) * size_t(range.first), &text_scratch[0], sizeof(text_vertex_t) * text_scratch.size());
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	text_layouts.emplace( key, text_layout_t{ range, text_frame, pages, text, _x, _y, scale, color } );
+	text_draws.push_back( range );
+	glyph_batch.resize( begin );
+}
+
+// like std::to_chars: writes the decimal digits of value without a terminator, and returns their count
+inline int format_int( char* buffer, int value )
+{
+	char digits[10]; int n = 0;
+	unsigned int u = value < 0 ? 0u - unsigned(value) : unsigned(value);
+	do { digits[n++] = char('0' + u % 10); u /= 10; } while (u);
+
+	int length = 0;
+	if (value < 0) buffer[length++] = '-';
+	while (n) buffer[length++] = digits[--n];
+	return length;
+}
+
+uint hud_number_create( GLint x, GLint y, GLfloat scale, vec4 color )
+{
+	assert( hud_number_count < max_hud_numbers && "too many HUD numbers" );
+	hud_number_t& h = hud_numbers[hud_number_count];
+	h.x = x; h.y = y; h.scale = scale; h.color = color; h.length = 0;
+	return uint(hud_number_count++);
+}
+
+void render_hud_number( uint handle, int value )
+{
+	if (!VAO) return;	// no font
+	hud_number_t& h = hud_numbers[handle];
+	const size_t first_glyph = text_cache_glyphs + size_t(handle) * hud_number_digits;
+
+	char text[hud_number_digits];
+	const int length = format_int( text, value );
+
+	// Rewrite only the digits whose character or position changed
+	GLfloat x = GLfloat(h.x);
+	for (int k = 0; k < length; k++)
+	{
+		const stbtt_char_t& ch = stbtt_char_table[(unsigned char)(text[k])];
+		if (k >= h.length || text[k] != h.text[k] || x != h.pen[k])
+		{
+			glyph_quad_t g = { ch.uv,
+				vec4(x + h.scale * ch.bearing.x, -GLfloat(h.y) - h.scale * (ch.size.y - ch.bearing.y), h.scale * ch.size.x, h.scale * ch.size.y),
+				h.color, 0.0f };
+			text_vertex_t v[6];
+			write_glyph_vertices( g, v );
+			text_cache_buffer.sub_data( sizeof(text_vertex_t) * 6 * (first_glyph + k), v, sizeof(v) );
+			h.text[k] = text[k]; h.pen[k] = x;
+		}
+		x += ch.advance * h.scale;
+	}
+	h.length = length;
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	text_draws.push_back({ GLint(6 * first_glyph), GLsizei(6 * length) });
+}
+
+void flush_text()
+{
+	extern gl_ring_buffer_t frame_ring;
+	if (!VAO) return;	// no font
+
+	glUseProgram(program_text);
+	glActiveTexture(GL_TEXTURE0 + atlas_unit);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, font_atlas);
+
+	// Draw the retained layouts and the HUD numbers with one multi-draw, merging ranges that are adjacent in the cache buffer
+	if (!text_draws.empty())
+	{
+		std::sort(text_draws.begin(), text_draws.end(), [](const text_range_t& a, const text_range_t& b) { return a.first < b.first; });
+		for (size_t k = 0, n = text_draws.size(); k < n; )
+		{
+			text_range_t r = text_draws[k++];
+			while (k < n && text_draws[k].first <= r.first + r.count) { r.count = max(r.count, text_draws[k].first + text_draws[k].count - r.first); k++; }
+			text_draw_firsts.push_back(r.first);
+			text_draw_counts.push_back(r.count);
+		}
+		glBindVertexArray(cache_VAO);
+		glMultiDrawArrays(GL_TRIANGLES, &text_draw_firsts[0], &text_draw_counts[0], GLsizei(text_draw_firsts.size()));
+		text_draws.clear(); text_draw_firsts.clear(); text_draw_counts.clear();
+	}
+
+	// Write one vertex stream for the remaining glyphs into the frame ring
+	size_t offset = 0;
+	text_vertex_t* v = glyph_batch.empty() ? nullptr : (text_vertex_t*) frame_ring.alloc(sizeof(text_vertex_t) * 6 * glyph_batch.size(), sizeof(text_vertex_t), offset);
+	if (v)
+	{
+		for (const glyph_quad_t& g : glyph_batch) v = write_glyph_vertices(g, v);
+		frame_ring.commit();
+		glBindVertexArray(VAO);
+		glDrawArrays(GL_TRIANGLES, GLint(offset / sizeof(text_vertex_t)), GLsizei(6 * glyph_batch.size()));
+	}
 	glBindVertexArray(0);
-	glBindTexture(GL_TEXTURE_2D, 0);
-}
\ No newline at end of file
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	glyph_batch.clear();
+
+	// Evict layouts not drawn in this frame, and give their ranges back to the cache
+	for (auto it = text_layouts.begin(); it != text_layouts.end(); )
+	{
+		if (it->second.last_frame == text_frame) { ++it; continue; }
+		text_cache_release(it->second.range);
+		it = text_layouts.erase(it);
+	}
+	text_frame++;
+}
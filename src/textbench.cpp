@@ -0,0 +1,126 @@
+#include <chrono>			// standard headers come before cgmath.h, whose min/max macros break them
+#include "cgmath.h"			// slee's simple math library
+#include "cgut.h"			// slee's OpenGL utility
+#include "glprof.h"			// GL call counters and GPU timers
+
+//*******************************************************************
+// text renderer under test (text.cpp)
+void text_init();
+void text_finalize();
+void render_text(const char* text, GLint x, GLint y, GLfloat scale, vec4 color);
+void flush_text();
+
+//*************************************
+// globals that text.cpp shares with the game
+bool				b_sdf_text = false;	// render text from a signed distance field atlas?
+gl_ring_buffer_t	frame_ring;			// per-frame data of the text renderer
+
+//*************************************
+// benchmark settings
+static const char*	window_name = "Text benchmark";
+ivec2				window_size = ivec2( 1024, 576 );
+int					warmup_frames = 10;
+int					measured_frames = 200;
+
+struct bench_case_t
+{
+	int		length;		// glyphs per string
+	int		count;		// strings per frame
+	float	scale;
+	bool	retained;	// the same strings every frame, or strings laid out again every frame
+};
+
+struct bench_result_t
+{
+	double	cpu_ns_per_glyph;
+	double	calls_per_glyph;
+	double	draws_per_frame;
+	double	gpu_ns_per_glyph;
+};
+
+bench_result_t run_case( const bench_case_t& c, gl_gpu_timer_t& timer )
+{
+	// a string of printable characters of the given length
+	char text[256]; int length = min( c.length, int(sizeof(text))-1 );
+	for( int k=0; k < length; k++ ) text[k] = char('!' + (k*7)%94);
+	text[length] = '\0';
+
+	gl_call_stats_t& stats = gl_call_stats_t::instance();
+	uint calls=0, draws=0;
+	double cpu_ns=0;
+	timer.collect( true ); timer.reset();
+
+	for( int frame=0; frame < warmup_frames+measured_frames; frame++ )
+	{
+		const bool measure = frame>=warmup_frames;
+		frame_ring.begin_frame();
+		glClear( GL_COLOR_BUFFER_BIT );
+		cg_bind_frame_block( frame_ring, mat4(), mat4(), window_size, 0.0f );
+
+		// retained strings keep their layout; the others move by a pixel every frame, so they are laid out again
+		const GLint x = 10 + (c.retained ? 0 : frame%2);
+		const uint calls0=stats.calls, draws0=stats.draws;
+		if(measure) timer.begin();
+		auto t0 = std::chrono::steady_clock::now();
+		for( int k=0; k < c.count; k++ ) render_text( text, x, 40 + (k*8)%(window_size.y-40), c.scale, vec4(1.0f) );
+		flush_text();
+		auto t1 = std::chrono::steady_clock::now();
+		if(measure)
+		{
+			timer.end();
+			cpu_ns += double(std::chrono::duration_cast<std::chrono::nanoseconds>(t1-t0).count());
+			calls += stats.calls-calls0; draws += stats.draws-draws0;
+		}
+		frame_ring.end_frame();
+		timer.collect();
+	}
+	glFinish();
+	timer.collect( true );
+
+	const double glyphs = double(length)*c.count*measured_frames;
+	return { cpu_ns/glyphs, calls/glyphs, double(draws)/measured_frames, timer.total_ms*1e6/glyphs };
+}
+
+int main( int argc, char* argv[] )
+{
+	for( int k=1; k < argc; k++ )
+	{
+		if(strcmp(argv[k],"--sdf")==0) b_sdf_text = true;
+		else if(strcmp(argv[k],"--frames")==0&&k+1<argc) measured_frames = max( 1, atoi(argv[++k]) );
+		else { printf( "usage: %s [--sdf] [--frames N]\n", argv[0] ); return 1; }
+	}
+
+	// create a hidden window for an offscreen context
+	if(!glfwInit()){ printf( "[error] failed in glfwInit()\n" ); return 1; }
+	GLFWwindow* window = cg_create_window( window_name, window_size.x, window_size.y, false );
+	if(!window){ glfwTerminate(); return 1; }
+	if(!cg_init_extensions( window )){ glfwTerminate(); return 1; }
+	glfwGetFramebufferSize( window, &window_size.x, &window_size.y );
+	glViewport( 0, 0, window_size.x, window_size.y );
+	glEnable( GL_BLEND );
+	glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
+
+	frame_ring.create( 4*1024*1024 );
+	text_init();
+	gl_gpu_timer_t timer; timer.create();
+	glprof_install();
+
+	printf( "%s text, %d frames per case\n", b_sdf_text?"SDF":"bitmap", measured_frames );
+	printf( "%-9s %6s %6s %6s %14s %15s %12s %14s\n", "mode", "length", "count", "scale", "CPU ns/glyph", "GL calls/glyph", "draws/frame", "GPU ns/glyph" );
+	for( bool retained : { true, false } )
+		for( int length : { 8, 32, 128 } )
+			for( int count : { 1, 16, 64 } )
+				for( float scale : { 0.5f, 1.0f } )
+				{
+					bench_result_t r = run_case( { length, count, scale, retained }, timer );
+					printf( "%-9s %6d %6d %6.2f %14.1f %15.3f %12.1f %14.2f\n", retained?"retained":"relayout", length, count, scale, r.cpu_ns_per_glyph, r.calls_per_glyph, r.draws_per_frame, r.gpu_ns_per_glyph );
+				}
+
+	glprof_uninstall();
+	timer.release();
+	text_finalize();
+	frame_ring.release();
+	glfwDestroyWindow( window );
+	glfwTerminate();
+	return 0;
+}